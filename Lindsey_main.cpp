@@ -22,6 +22,44 @@ PLEASE FILL OUT THIS SECTION PRIOR TO SUBMISSION
 #include <fstream>
 #include <cmath>
 #include <string>
+#include <algorithm>
+#include <chrono>
+#include <functional>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <exception>
+#include <cstring>
+#include <cstdlib>
+#include <cstdio>
+#include <cctype>
+#include <filesystem>
+#include <memory>
+#include <map>
+#include <sstream>
+#include <iomanip>
+#include <bitset>
+#ifdef _WIN32
+#include <io.h>
+#include <fcntl.h>
+#include <process.h>
+#define getpid _getpid
+#endif
+#ifdef __linux__
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <fcntl.h>
+#include <linux/mempolicy.h>
+#include <sched.h>
+#include <unistd.h>
+#endif
+#if defined(IMAGE_PROFILE) && defined(__linux__)
+#include <linux/perf_event.h>
+#endif
 using namespace std;
 
 //***************************************************************************************************//
@@ -239,712 +277,7140 @@ bool write_image(string filename, const vector<vector<Pixel>>& image)
 // YOUR FUNCTION DEFINITIONS HERE
 //
 
-/**
- * Description - Displays the program's introduction message
- */
-void intro_message()
+//
+// BUFFER PLACEMENT
+//
+
+// Where the memory of large image buffers comes from
+enum Placement_Policy
 {
-    cout << endl << "CSPB 1300 Image Processing Application" << endl;
-}
+    Placement_Default = 0,      // Ordinary pages, placed on the node of whichever thread writes them first
+    Placement_Huge_Transparent, // Ordinary pages with transparent hugepages requested
+    Placement_Huge_Explicit,    // Reserved hugepages (MAP_HUGETLB), falling back to transparent ones
+    Placement_First_Touch,      // make_buffer() faults the pages in from the worker that will process those rows
+    Placement_Interleave        // Pages spread round robin over all NUMA nodes
+};
+
+const char* PLACEMENT_NAMES[] = {"default", "thp", "hugetlb", "first-touch", "interleave"};
+const int PLACEMENT_COUNT = 5;
+
+// Policy used for new large buffers, and whether the workers are pinned to CPUs so first touch placement sticks
+Placement_Policy buffer_placement = Placement_Default;
+bool pin_workers = false;
+
+// Buffers at least this big are mapped directly, rounded up to whole 2 MB hugepages
+const size_t HUGE_PAGE = 1 << 21;
+const size_t LARGE_ALLOCATION = HUGE_PAGE;
+
+// Directly mapped buffers and their mapped lengths, since the policy may change before they are freed
+map<void*, size_t> mapped_buffers;
+mutex mapped_buffers_lock;
 
 /**
- * Description - Displays menu selection and prompts user to make selection
- * @return the user's menu selection as an int
+ * Description - Bit mask of the online NUMA nodes (node 0 only when it cannot be read)
+ * @return the node mask
  */
-int menu_selection()
+unsigned long numa_node_mask()
 {
-    int selection;
-    cout << endl << "----------------------------------" << endl;
-    cout << "IMAGE PROCESSING MENU" << endl;
-    cout << "0) Change image (current: sample.bmp)" << endl;
-    cout << "1) Vignette" << endl;
-    cout << "2) Clarendon" << endl;
-    cout << "3) Grayscale" << endl;
-    cout << "4) Rotate 90 degrees" << endl;
-    cout << "5) Rotate multiple 90 degrees" << endl;
-    cout << "6) Enlarge" << endl;
-    cout << "7) High contrast" << endl;
-    cout << "8) Lighten" << endl;
-    cout << "9) Darken" << endl;
-    cout << "10) Black, white, red, green, blue" << endl;
-    cout << "----------------------------------" << endl;
-
-    cout << endl << "Enter menu selection (Q to quit): "; // Good
-    cin >> selection;
-    cout << endl;
-    
-    return selection;
+    static unsigned long mask = []()
+    {
+        unsigned long nodes = 0;
+        ifstream online("/sys/devices/system/node/online");
+        string ranges;
+        online >> ranges;
+        stringstream parts(ranges);
+        string part;
+        while (getline(parts, part, ','))
+        {
+            int first = atoi(part.c_str());
+            int last = part.find('-') != string::npos ? atoi(part.c_str() + part.find('-') + 1) : first;
+            for (int node = first; node <= last && node < 64; node++)
+            {
+                nodes |= 1UL << node;
+            }
+        }
+        return nodes != 0 ? nodes : 1UL;
+    }();
+    return mask;
 }
 
 /**
- * Description - Sets the input filename from the user's input
- * @return the name of the initial input filename as a string
+ * Description - Allocates zeroed memory for an image buffer. With a placement policy other than the default, large
+ * buffers are mapped directly, aligned to a hugepage and set up for that policy; nothing is faulted in here. The
+ * default stays on the heap, which keeps reusing the pages of freed buffers instead of faulting in new ones.
+ * @param bytes number of bytes
+ * @return the memory (throws bad_alloc on failure)
  */
-string initial_input_filename()
+void* allocate_buffer_memory(size_t bytes)
 {
-    string initial_filename;
-    cout << "Enter input BMP filename: "; // Good
-    cin >> initial_filename;
-    return initial_filename;
+#ifdef __linux__
+    if (bytes >= LARGE_ALLOCATION && buffer_placement != Placement_Default)
+    {
+        size_t length = (bytes + HUGE_PAGE - 1) / HUGE_PAGE * HUGE_PAGE;
+        void* memory = MAP_FAILED;
+        if (buffer_placement == Placement_Huge_Explicit)
+        {
+            memory = mmap(nullptr, length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        }
+        if (memory == MAP_FAILED)
+        {
+            // Map one hugepage extra and trim both ends so the buffer starts on a hugepage boundary
+            char* mapping = (char*)mmap(nullptr, length + HUGE_PAGE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+            if (mapping == MAP_FAILED)
+            {
+                throw bad_alloc();
+            }
+            char* aligned = (char*)(((uintptr_t)mapping + HUGE_PAGE - 1) & ~(uintptr_t)(HUGE_PAGE - 1));
+            if (aligned > mapping)
+            {
+                munmap(mapping, aligned - mapping);
+            }
+            munmap(aligned + length, mapping + HUGE_PAGE - aligned);
+            memory = aligned;
+            if (buffer_placement == Placement_Huge_Transparent || buffer_placement == Placement_Huge_Explicit)
+            {
+                madvise(memory, length, MADV_HUGEPAGE);
+            }
+        }
+        if (buffer_placement == Placement_Interleave)
+        {
+            unsigned long nodes = numa_node_mask();
+            syscall(SYS_mbind, memory, length, MPOL_INTERLEAVE, &nodes, sizeof(nodes) * 8 + 1, 0);
+        }
+        lock_guard<mutex> lock(mapped_buffers_lock);
+        mapped_buffers[memory] = length;
+        return memory;
+    }
+#endif
+    void* memory = calloc(max(bytes, (size_t)1), 1);
+    if (memory == nullptr)
+    {
+        throw bad_alloc();
+    }
+    return memory;
 }
 
 /**
- * Description - Changes the input filename from the user's input. 
- * @return the name of the new input filename as a string
+ * Description - Frees memory from allocate_buffer_memory()
+ * @param memory the memory
+ * @param bytes  the size it was allocated with
  */
-string process_0()
+void free_buffer_memory(void* memory, size_t bytes)
 {
-    string new_filename;
-    cout << "Change Image selected" << endl;
-    cout << "Enter new input BMP filename: " << endl;
-    cin >> new_filename; 
-    cout << "Successfully changed input image!" << endl;
-    return new_filename;
+#ifdef __linux__
+    if (bytes >= LARGE_ALLOCATION)
+    {
+        lock_guard<mutex> lock(mapped_buffers_lock);
+        auto mapped = mapped_buffers.find(memory);
+        if (mapped != mapped_buffers.end())
+        {
+            munmap(memory, mapped->second);
+            mapped_buffers.erase(mapped);
+            return;
+        }
+    }
+#endif
+    free(memory);
 }
 
 /**
- * Description - Adds vignette effect to image (dark corners)
- * @param filename BMP image filename
- * @return the image as a vector of vector of Pixels
+ * Description - Allocator for image bytes. New memory is already zero, so growing a vector does not write it
+ * again: pages are first touched by whichever thread fills them. Growing a vector that shrank earlier leaves the
+ * reused bytes as they were.
  */
-vector<vector<Pixel>> process_1(const vector<vector<Pixel>>& image)
-{    
-    int num_rows = image.size(); // Gets the number of rows (height) in a 2D vector named image.
-    int num_cols = image[0].size(); // Gets the number of columns (i.e.) in a 2D vector named image.
+template <typename T>
+struct Buffer_Allocator
+{
+    using value_type = T;
 
-    vector<vector<Pixel>> new_new_image(num_rows, vector<Pixel> (num_cols));
+    Buffer_Allocator() = default;
+    template <typename U>
+    Buffer_Allocator(const Buffer_Allocator<U>&) {}
 
-    for (int row = 0; row < num_rows; row++)
+    T* allocate(size_t count) { return (T*)allocate_buffer_memory(count * sizeof(T)); }
+    void deallocate(T* memory, size_t count) { free_buffer_memory(memory, count * sizeof(T)); }
+
+    template <typename U>
+    void construct(U*) {}
+    template <typename U, typename... Args>
+    void construct(U* place, Args&&... args) { new (place) U(forward<Args>(args)...); }
+
+    template <typename U>
+    bool operator==(const Buffer_Allocator<U>&) const { return true; }
+    template <typename U>
+    bool operator!=(const Buffer_Allocator<U>&) const { return false; }
+};
+
+// Bytes of an image buffer
+using Buffer_Bytes = vector<unsigned char, Buffer_Allocator<unsigned char>>;
+
+/**
+ * Description - Pins the calling thread to the index-th CPU it is allowed to run on (Linux only)
+ * @param index the worker index
+ */
+void pin_to_cpu(int index)
+{
+#ifdef __linux__
+    cpu_set_t allowed;
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0 || CPU_COUNT(&allowed) == 0)
     {
-        for (int col = 0; col < num_cols; col++)
+        return;
+    }
+    int target = index % CPU_COUNT(&allowed);
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++)
+    {
+        if (CPU_ISSET(cpu, &allowed) && target-- == 0)
         {
-            // find the distance to the center
-            double distance = sqrt( pow((col - num_rows / 2),2) + pow((row - num_cols / 2),2));
-            double scaling_factor = (num_cols - distance) / num_cols;
-            
-            int red_color = image[row][col].red;
-            int green_color = image[row][col].green;
-            int blue_color = image[row][col].blue;
-
-            new_new_image[row][col].red   = red_color   * scaling_factor;
-            new_new_image[row][col].green = green_color * scaling_factor;
-            new_new_image[row][col].blue  = blue_color  * scaling_factor;
+            cpu_set_t only;
+            CPU_ZERO(&only);
+            CPU_SET(cpu, &only);
+            sched_setaffinity(0, sizeof(only), &only);
+            return;
         }
     }
-    return new_new_image;
+#endif
 }
 
-/**
- * Description - Process 1 Wrapper function. Takes input filename, calls read_image functions to transform the image into a vector,
- * calls process_1 function to apply Vignette, calls write_image fucntion to transform the new vector into a .bmp file, and prints success,
- * if the image transformation was successful.
- * @param input_filename BMP image filename
- */
-void process_1_wrapper(string input_filename)
+void parallel_rows(int num_rows, const function<void(int, int)>& body);
+
+//
+// STAGE PROFILER
+//
+
+#ifdef IMAGE_PROFILE
+
+// Counters read around every profiled stage
+enum Profile_Counter
 {
-    string output_filename = "";
-    vector<vector<Pixel>> image;
-    vector<vector<Pixel>> new_image;
-    bool success = true;
+    Counter_Task_Clock = 0,     // CPU time of all threads, in nanoseconds
+    Counter_Cycles,
+    Counter_Instructions,
+    Counter_Cache_Misses,       // last level cache misses
+    Counter_Branch_Misses,
+    COUNTER_COUNT
+};
 
-    cout << "Vignette selected" << endl;
-    cout << "Enter output BMP filename: ";
-    cin >> output_filename;                
+// Totals of one stage over all its calls
+struct Stage_Totals
+{
+    long long calls = 0;
+    double wall_ns = 0;
+    double counters[COUNTER_COUNT] = {};
+    long long bytes = 0;
+};
 
-    image = read_image(input_filename); 
-    new_image = process_1(image); 
-    success = write_image(output_filename, new_image);
-    
-    if (success == true)
-    { cout << "Successfully applied Vignette!" << endl; }
-    else
-    { cout << "Process 1 failed" << endl; } 
-}
+// Counter file descriptors of one thread, -1 where a counter is not available
+struct Thread_Counters
+{
+    int fds[COUNTER_COUNT];
+};
+
+mutex profile_lock;
+vector<Thread_Counters> profiled_threads;
+map<string, Stage_Totals> stage_totals;
+bool counter_available[COUNTER_COUNT] = {};
 
 /**
- * Status == working, needs clean up
- * Description - Adds Clarendon effect to image (darks darker and lights lighter) by a scaling factor
- * @param filename BMP image filename
- * @return the image as a vector of vector of Pixels
+ * Description - Opens the counters of the calling thread, once per thread. Each counter is opened on its own so
+ * the ones the hardware or the kernel refuses (virtual machines often have no PMU) are simply reported as n/a.
  */
-vector<vector<Pixel>> process_2(const vector<vector<Pixel>>& image, double scaling_factor)
-{    
-    int num_rows = image.size(); 
-    int num_cols = image[0].size(); 
-
-    vector<vector<Pixel>> new_new_image(num_rows, vector<Pixel> (num_cols));
-
-    for (int row = 0; row < num_rows; row++)
+void profile_thread_start()
+{
+    thread_local bool started = false;
+    if (started)
     {
-        for (int col = 0; col < num_cols; col++)
-        {          
-            int red_color = image[row][col].red;
-            int green_color = image[row][col].green;
-            int blue_color = image[row][col].blue;
+        return;
+    }
+    started = true;
 
-            double average_value = (red_color + green_color + blue_color) / 3;
+    Thread_Counters counters;
+    fill_n(counters.fds, COUNTER_COUNT, -1);
+#ifdef __linux__
+    const pair<unsigned int, unsigned long long> EVENTS[COUNTER_COUNT] =
+    {
+        {PERF_TYPE_SOFTWARE, PERF_COUNT_SW_TASK_CLOCK},
+        {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES},
+        {PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS},
+        {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES},
+        {PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES}
+    };
+    for (int k = 0; k < COUNTER_COUNT; k++)
+    {
+        perf_event_attr attributes;
+        memset(&attributes, 0, sizeof(attributes));
+        attributes.size = sizeof(attributes);
+        attributes.type = EVENTS[k].first;
+        attributes.config = EVENTS[k].second;
+        attributes.exclude_kernel = 1;
+        attributes.exclude_hv = 1;
+        attributes.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+        counters.fds[k] = syscall(SYS_perf_event_open, &attributes, 0, -1, -1, 0);
+    }
+#endif
+    lock_guard<mutex> lock(profile_lock);
+    profiled_threads.push_back(counters);
+    for (int k = 0; k < COUNTER_COUNT; k++)
+    {
+        counter_available[k] = counter_available[k] || counters.fds[k] >= 0;
+    }
+}
 
-            if (average_value >= 170)
-            {
-                new_new_image[row][col].red   = (255 - (255 - red_color)   * scaling_factor);
-                new_new_image[row][col].green = (255 - (255 - green_color) * scaling_factor);
-                new_new_image[row][col].blue  = (255 - (255 - blue_color)  * scaling_factor);
-            }
-            else if (average_value < 90)
-            {
-                new_new_image[row][col].red   = red_color   * scaling_factor;
-                new_new_image[row][col].green = green_color * scaling_factor;
-                new_new_image[row][col].blue  = blue_color  * scaling_factor;
-            }
-            else
+/**
+ * Description - Sums every counter over all profiled threads, so stages that run on the worker pool are counted
+ * in full. Counts are scaled up when the kernel had to multiplex the counters.
+ * @param totals the sums, one per counter
+ */
+void read_profile_counters(double totals[COUNTER_COUNT])
+{
+    fill_n(totals, COUNTER_COUNT, 0.0);
+#ifdef __linux__
+    lock_guard<mutex> lock(profile_lock);
+    for (const Thread_Counters& counters : profiled_threads)
+    {
+        for (int k = 0; k < COUNTER_COUNT; k++)
+        {
+            unsigned long long values[3];   // value, time enabled, time running
+            if (counters.fds[k] >= 0 && read(counters.fds[k], values, sizeof(values)) == sizeof(values) && values[2] > 0)
             {
-                new_new_image[row][col].red   = red_color;
-                new_new_image[row][col].green = green_color;
-                new_new_image[row][col].blue  = blue_color;
+                totals[k] += (double)values[0] * values[1] / values[2];
             }
         }
     }
-    return new_new_image;
+#endif
 }
 
 /**
- * Description - Process 2 Wrapper function. Takes input filename, calls read_image functions to transform the image into a vector,
- * calls process_2 function to apply Clarendon, calls write_image fucntion to transform the new vector into a .bmp file, and prints success,
- * if the image transformation was successful.
- * @param input_filename BMP image filename
+ * Description - Prints one row per stage: calls, wall and CPU time, IPC, cache and branch misses per thousand
+ * instructions, the bandwidth of the bytes the stage declared and the bandwidth implied by 64-byte cache misses.
+ * A stage with low IPC and many cache misses is memory bound; high IPC means it is compute bound.
  */
-void process_2_wrapper(string input_filename)
+void print_stage_profile()
 {
-    string output_filename = "";
-    vector<vector<Pixel>> image;
-    vector<vector<Pixel>> new_image;
-    double scaling_factor = 1;
-    bool success = true;
-    
-    cout << "Clarendon selected" << endl;
-    cout << "Enter output BMP filename: ";
-    cin >> output_filename;
-    cout << "Enter scaling factor: "; // Use 0.3
-    cin >> scaling_factor;
-    
-    image = read_image(input_filename); 
-    new_image = process_2(image, scaling_factor);
-    success = write_image(output_filename, new_image);
-    
-    if (success == true)
-    { cout << "Successfully applied Clarendon!" << endl; }
-    else
-    { cout << "Process 2 failed" << endl; }
+    lock_guard<mutex> lock(profile_lock);
+    if (stage_totals.empty())
+    {
+        return;
+    }
+    auto available = [](int k, double value, int precision)
+    {
+        ostringstream text;
+        if (counter_available[k])
+        {
+            text << fixed << setprecision(precision) << value;
+        }
+        else
+        {
+            text << "n/a";
+        }
+        return text.str();
+    };
+
+    cout << left << setw(24) << "Stage" << right << setw(7) << "calls" << setw(10) << "wall ms" << setw(10) << "cpu ms"
+         << setw(7) << "IPC" << setw(11) << "cache MPKI" << setw(12) << "branch MPKI" << setw(9) << "GB/s"
+         << setw(11) << "miss GB/s" << "  bound" << endl;
+    for (const auto& stage : stage_totals)
+    {
+        const Stage_Totals& totals = stage.second;
+        double instructions = max(totals.counters[Counter_Instructions], 1.0);
+        double ipc = totals.counters[Counter_Instructions] / max(totals.counters[Counter_Cycles], 1.0);
+        double cache_mpki = totals.counters[Counter_Cache_Misses] * 1000 / instructions;
+        double branch_mpki = totals.counters[Counter_Branch_Misses] * 1000 / instructions;
+        double seconds = max(totals.wall_ns, 1.0) / 1e9;
+        string bound = "-";
+        if (counter_available[Counter_Cycles] && counter_available[Counter_Instructions] && counter_available[Counter_Cache_Misses])
+        {
+            bound = ipc < 1 && cache_mpki > 5 ? "memory" : ipc < 1 && branch_mpki > 5 ? "branches" : "compute";
+        }
+        cout << left << setw(24) << stage.first << right << setw(7) << totals.calls
+             << setw(10) << fixed << setprecision(2) << totals.wall_ns / 1e6
+             << setw(10) << available(Counter_Task_Clock, totals.counters[Counter_Task_Clock] / 1e6, 2)
+             << setw(7) << available(Counter_Instructions, ipc, 2)
+             << setw(11) << available(Counter_Cache_Misses, cache_mpki, 2)
+             << setw(12) << available(Counter_Branch_Misses, branch_mpki, 2)
+             << setw(9) << setprecision(2) << totals.bytes / seconds / 1e9
+             << setw(11) << available(Counter_Cache_Misses, totals.counters[Counter_Cache_Misses] * 64 / seconds / 1e9, 2)
+             << "  " << bound << defaultfloat << endl;
+    }
+    stage_totals.clear();
 }
 
 /**
- * Status == working, needs clean up
- * Description - Grayscale image
- * @param filename BMP image filename
- * @return the image as a vector of vector of Pixels
+ * Description - Measures one stage from construction to destruction and adds it to the stage totals. The table
+ * is printed when the program exits. Stages should not nest, or the outer one counts the inner one's work too.
  */
-vector<vector<Pixel>> process_3(const vector<vector<Pixel>>& image)
-{    
-    int num_rows = image.size();
-    int num_cols = image[0].size();
-
-    vector<vector<Pixel>> new_new_image(num_rows, vector<Pixel> (num_cols));
+class Stage_Profiler
+{
+public:
+    Stage_Profiler(const char* name, long long bytes) : bytes(bytes), name(name)
+    {
+        profile_thread_start();
+        read_profile_counters(start_counters);
+        start = chrono::steady_clock::now();
+    }
 
-    for (int row = 0; row < num_rows; row++)
+    ~Stage_Profiler()
     {
-        for (int col = 0; col < num_cols; col++)
-        {         
-            int red_color = image[row][col].red;
-            int green_color = image[row][col].green;
-            int blue_color = image[row][col].blue;
-            double gray_value = (red_color + green_color + blue_color) / 3;
+        auto end = chrono::steady_clock::now();
+        double end_counters[COUNTER_COUNT];
+        read_profile_counters(end_counters);
 
-            new_new_image[row][col].red   = gray_value;
-            new_new_image[row][col].green = gray_value;
-            new_new_image[row][col].blue  = gray_value;
+        lock_guard<mutex> lock(profile_lock);
+        static bool print_at_exit = (atexit(print_stage_profile), true);
+        (void)print_at_exit;
+        Stage_Totals& totals = stage_totals[name];
+        totals.calls++;
+        totals.wall_ns += chrono::duration<double, nano>(end - start).count();
+        totals.bytes += bytes;
+        for (int k = 0; k < COUNTER_COUNT; k++)
+        {
+            totals.counters[k] += end_counters[k] - start_counters[k];
         }
     }
-    return new_new_image;
-}
 
-/**
+    long long bytes;
+
+private:
+    const char* name;
+    double start_counters[COUNTER_COUNT];
+    chrono::steady_clock::time_point start;
+};
+
+// Profiles the rest of the enclosing scope as the named stage, moving the given number of bytes
+#define PROFILE_STAGE(name, byte_count) Stage_Profiler stage_profiler(name, byte_count)
+// Adds bytes only known later in the stage
+#define PROFILE_BYTES(byte_count) (stage_profiler.bytes += (byte_count))
+
+#else
+
+#define PROFILE_STAGE(name, byte_count)
+#define PROFILE_BYTES(byte_count)
+
+#endif
+
+//
+// CONTIGUOUS IMAGE BUFFER
+//
+
+/**
+ * Description - Contiguous image used by the fast code paths. Pixels are stored top to bottom, left to right,
+ * as interleaved 8-bit red, green, blue values so whole rows can be processed with simple loops.
+ */
+struct Image_Buffer
+{
+    int width = 0;
+    int height = 0;
+    int channels = 3;
+    Buffer_Bytes data;
+
+    unsigned char* row(int r) { return data.data() + (size_t)r * width * channels; }
+    const unsigned char* row(int r) const { return data.data() + (size_t)r * width * channels; }
+};
+
+/**
+ * Description - Creates an image buffer of the given size
+ * @param width    width in pixels
+ * @param height   height in pixels
+ * @param channels number of 8-bit channels per pixel
+ * @return the new (zeroed) image buffer
+ */
+Image_Buffer make_buffer(int width, int height, int channels = 3)
+{
+    Image_Buffer image;
+    image.width = width;
+    image.height = height;
+    image.channels = channels;
+    image.data.resize((size_t)width * height * channels);
+
+    if (buffer_placement == Placement_First_Touch && image.data.size() >= LARGE_ALLOCATION)
+    {
+        // Fault the pages in from the workers, in the same row blocks parallel_rows() hands them later
+        const size_t PAGE = 4096;
+        size_t row_bytes = (size_t)width * channels;
+        parallel_rows(height, [&](int first_row, int end_row)
+        {
+            size_t first_page = (first_row * row_bytes + PAGE - 1) / PAGE * PAGE;
+            for (size_t offset = first_page; offset < end_row * row_bytes; offset += PAGE)
+            {
+                image.data[offset] = 0;
+            }
+        });
+    }
+    return image;
+}
+
+/**
+ * Description - Copies a vector of vector of Pixels into a contiguous image buffer.
+ * Values are narrowed to bytes the same way write_image() does it.
+ * @param image the image as a vector of vector of Pixels
+ * @return the image as an image buffer
+ */
+Image_Buffer pixels_to_buffer(const vector<vector<Pixel>>& image)
+{
+    if (image.empty() || image[0].empty())
+    {
+        return Image_Buffer();
+    }
+    PROFILE_STAGE("pixels to buffer", (long long)image.size() * image[0].size() * (sizeof(Pixel) + 3));
+    Image_Buffer buffer = make_buffer(image[0].size(), image.size());
+    for (int row = 0; row < buffer.height; row++)
+    {
+        unsigned char* out = buffer.row(row);
+        for (int col = 0; col < buffer.width; col++)
+        {
+            out[3 * col]     = (unsigned char)image[row][col].red;
+            out[3 * col + 1] = (unsigned char)image[row][col].green;
+            out[3 * col + 2] = (unsigned char)image[row][col].blue;
+        }
+    }
+    return buffer;
+}
+
+/**
+ * Description - Copies a contiguous image buffer into a vector of vector of Pixels
+ * @param buffer the image buffer
+ * @return the image as a vector of vector of Pixels
+ */
+vector<vector<Pixel>> buffer_to_pixels(const Image_Buffer& buffer)
+{
+    PROFILE_STAGE("buffer to pixels", (long long)buffer.width * buffer.height * (sizeof(Pixel) + buffer.channels));
+    vector<vector<Pixel>> image(buffer.height, vector<Pixel> (buffer.width));
+    for (int row = 0; row < buffer.height; row++)
+    {
+        const unsigned char* in = buffer.row(row);
+        for (int col = 0; col < buffer.width; col++)
+        {
+            image[row][col].red   = in[buffer.channels * col];
+            image[row][col].green = in[buffer.channels * col + 1];
+            image[row][col].blue  = in[buffer.channels * col + 2];
+        }
+    }
+    return image;
+}
+
+/**
+ * Description - Gives a filtered image the alpha channel of the image it was made from, so filters that only
+ * work on red, green and blue keep the transparency of 32-bit images. Nothing happens when the source has no
+ * alpha or the size changed.
+ * @param source the unfiltered image
+ * @param result the filtered image, widened to 4 channels if needed
+ */
+void keep_alpha(const Image_Buffer& source, Image_Buffer& result)
+{
+    if (source.channels != 4 || result.width != source.width || result.height != source.height)
+    {
+        return;
+    }
+    if (result.channels == 3)
+    {
+        Image_Buffer widened = make_buffer(result.width, result.height, 4);
+        const unsigned char* in = result.data.data();
+        unsigned char* out = widened.data.data();
+        for (size_t i = 0, count = (size_t)result.width * result.height; i < count; i++)
+        {
+            out[4 * i]     = in[3 * i];
+            out[4 * i + 1] = in[3 * i + 1];
+            out[4 * i + 2] = in[3 * i + 2];
+        }
+        result = move(widened);
+    }
+    if (result.channels == 4)
+    {
+        for (size_t i = 3; i < result.data.size(); i += 4)
+        {
+            result.data[i] = source.data[i];
+        }
+    }
+}
+
+/**
+ * Description - Drops the alpha channel of a 32-bit image, for formats that only hold red, green and blue
+ * @param image the image
+ * @return the image with 3 channels
+ */
+Image_Buffer without_alpha(const Image_Buffer& image)
+{
+    if (image.channels == 3)
+    {
+        return image;
+    }
+    Image_Buffer result = make_buffer(image.width, image.height, 3);
+    for (size_t i = 0, count = (size_t)image.width * image.height; i < count; i++)
+    {
+        copy_n(&image.data[image.channels * i], 3, &result.data[3 * i]);
+    }
+    return result;
+}
+
+/**
+ * Description - Reads a little endian integer out of a byte array
+ * @param bytes the byte array
+ * @param count the number of bytes to read
+ * @return the integer
+ */
+long long get_int_from_bytes(const unsigned char* bytes, int count)
+{
+    long long result = 0;
+    for (int i = count - 1; i >= 0; i--)
+    {
+        result = result * 256 + bytes[i];
+    }
+    return result;
+}
+
+// Limits the fast decoder checks before allocating anything. Both can be changed on the command line.
+struct Decode_Limits
+{
+    long long max_pixels = 1LL << 28;   // 268 million pixels
+    long long max_bytes = 1LL << 30;    // 1 GiB, for the input file and for the decoded buffer
+};
+Decode_Limits decode_limits;
+
+/**
+ * Description - Reads a whole file into memory with a single read
+ * @param filename  the file to read
+ * @param bytes     the file contents
+ * @param max_bytes files larger than this are rejected before anything is allocated
+ * @return True if successful and false otherwise
+ */
+bool read_file(string filename, vector<unsigned char>& bytes, long long max_bytes = decode_limits.max_bytes)
+{
+    PROFILE_STAGE("read file", 0);
+    ifstream stream(filename, ios::in | ios::binary);
+    if (!stream.is_open())
+    {
+        return false;
+    }
+    stream.seekg(0, ios::end);
+    long long length = stream.tellg();
+    stream.seekg(0, ios::beg);
+    if (length < 0 || length > max_bytes)
+    {
+        return false;
+    }
+    bytes.resize(length);
+    PROFILE_BYTES(length);
+    stream.read((char*)bytes.data(), length);
+    return (bool)stream;
+}
+
+/**
+ * Description - Writes a whole file with a single write
+ * @param filename the file to write
+ * @param bytes    the file contents
+ * @return True if successful and false otherwise
+ */
+bool write_file(string filename, const vector<unsigned char>& bytes)
+{
+    PROFILE_STAGE("write file", bytes.size());
+    ofstream stream(filename, ios::out | ios::binary);
+    if (!stream.is_open())
+    {
+        return false;
+    }
+    stream.write((const char*)bytes.data(), bytes.size());
+    return (bool)stream;
+}
+
+/**
+ * Description - Decodes a 24 or 32-bit uncompressed BMP file held in memory into a contiguous buffer.
+ * Every header field is checked against the data that is actually there and against the limits before the
+ * image is allocated, so a hostile header cannot cause a huge allocation or a read past the end.
+ * @param file   the BMP file contents
+ * @param size   the number of bytes in file
+ * @param image  the image buffer to fill in
+ * @param limits the decode limits
+ * @return True if successful and false otherwise
+ */
+bool decode_bmp(const unsigned char* file, size_t size, Image_Buffer& image, const Decode_Limits& limits = decode_limits)
+{
+    PROFILE_STAGE("decode bmp", 0);
+    const int HEADER_SIZE = 54;
+    long long length = size;
+    if (length < HEADER_SIZE || length > limits.max_bytes || file[0] != 'B' || file[1] != 'M')
+    {
+        return false;
+    }
+
+    long long start = get_int_from_bytes(&file[10], 4);
+    long long dib_header_size = get_int_from_bytes(&file[14], 4);
+    long long width = (int)get_int_from_bytes(&file[18], 4);
+    long long height = (int)get_int_from_bytes(&file[22], 4);
+    int planes = get_int_from_bytes(&file[26], 2);
+    int bits_per_pixel = get_int_from_bytes(&file[28], 2);
+    int compression = get_int_from_bytes(&file[30], 4);
+    int bytes_per_pixel = bits_per_pixel / 8;
+
+    // A negative height marks a top-down image
+    bool top_down = height < 0;
+    height = top_down ? -height : height;
+
+    // BITMAPINFOHEADER, its V2 and V3 extensions with the color masks inside, and the V4 and V5 headers
+    bool known_header = dib_header_size == 40 || dib_header_size == 52 || dib_header_size == 56 ||
+                        dib_header_size == 108 || dib_header_size == 124;
+    if (!known_header || planes != 1 || width <= 0 || height <= 0)
+    {
+        return false;
+    }
+    if (!(bits_per_pixel == 24 && compression == 0) && !(bits_per_pixel == 32 && (compression == 0 || compression == 3)))
+    {
+        return false;
+    }
+    if (width * height > limits.max_pixels || width * height * 4 > limits.max_bytes)
+    {
+        return false;
+    }
+
+    // The pixels start after the DIB header, and after the three color masks that follow a 40 byte header in
+    // BI_BITFIELDS files. Larger headers hold the masks themselves, so every mask read below is before start.
+    long long header_end = 14 + dib_header_size + (compression == 3 && dib_header_size == 40 ? 12 : 0);
+    long long scanline_size = (width * bytes_per_pixel + 3) / 4 * 4;
+    if (header_end > length || start < header_end || start > length || scanline_size * height > length - start)
+    {
+        return false;
+    }
+
+    // Byte of each pixel holding red, green, blue and alpha, -1 for no alpha. BI_BITFIELDS masks may put the
+    // channels in any byte order; masks that are not whole distinct bytes are rejected.
+    int offsets[4] = {2, 1, 0, 3};
+    if (compression == 3)
+    {
+        int used = 0;
+        for (int c = 0; c < 4; c++)
+        {
+            // Only headers of 56 bytes or more have an alpha mask
+            long long mask = c < 3 || dib_header_size >= 56 ? get_int_from_bytes(&file[54 + 4 * c], 4) : 0;
+            offsets[c] = -1;
+            for (int byte = 0; byte < 4; byte++)
+            {
+                if (mask == 0xFFLL << (8 * byte))
+                {
+                    offsets[c] = byte;
+                }
+            }
+            if ((offsets[c] < 0 && (c < 3 || mask != 0)) || (offsets[c] >= 0 && (used & (1 << offsets[c]))))
+            {
+                return false;
+            }
+            used |= offsets[c] >= 0 ? 1 << offsets[c] : 0;
+        }
+    }
+    int red = offsets[0];
+    int green = offsets[1];
+    int blue = offsets[2];
+    int alpha = offsets[3];
+
+    // 32-bit images keep their alpha channel
+    int channels = bytes_per_pixel;
+    image = make_buffer(width, height, channels);
+    PROFILE_BYTES(scanline_size * height + (long long)image.data.size());
+
+    // BMP files store pixels from bottom to top (unless top_down), normally in blue, green, red (alpha) order
+    unsigned char any_alpha = 0;
+    for (int row = 0; row < image.height; row++)
+    {
+        const unsigned char* in = &file[start + scanline_size * (top_down ? row : image.height - 1 - row)];
+        unsigned char* out = image.row(row);
+        for (int col = 0; col < image.width; col++)
+        {
+            out[channels * col]     = in[bytes_per_pixel * col + red];
+            out[channels * col + 1] = in[bytes_per_pixel * col + green];
+            out[channels * col + 2] = in[bytes_per_pixel * col + blue];
+        }
+        if (channels == 4 && alpha >= 0)
+        {
+            for (int col = 0; col < image.width; col++)
+            {
+                out[4 * col + 3] = in[4 * col + alpha];
+                any_alpha |= in[4 * col + alpha];
+            }
+        }
+    }
+
+    // Many writers leave the fourth byte zero to mean "unused", which would make the image invisible
+    if (channels == 4 && any_alpha == 0)
+    {
+        for (size_t i = 3; i < image.data.size(); i += 4)
+        {
+            image.data[i] = 255;
+        }
+    }
+    return true;
+}
+
+/**
+ * Description - Decodes a BMP file held in a vector, see above
+ * @param file  the BMP file contents
+ * @param image the image buffer to fill in
+ * @return True if successful and false otherwise
+ */
+bool decode_bmp(const vector<unsigned char>& file, Image_Buffer& image)
+{
+    return decode_bmp(file.data(), file.size(), image);
+}
+
+/**
+ * Description - Encodes a 4 channel image buffer as a 32-bit BMP file with alpha (BI_BITFIELDS and a
+ * BITMAPV4HEADER holding the channel masks)
+ * @param image the image buffer
+ * @return the BMP file contents
+ */
+vector<unsigned char> encode_bmp_32(const Image_Buffer& image)
+{
+    PROFILE_STAGE("encode bmp", image.data.size() * 2);
+    const int HEADER_SIZE = 14 + 108;
+    int array_bytes = image.width * 4 * image.height;
+    vector<unsigned char> file(HEADER_SIZE + (size_t)array_bytes, 0);
+
+    set_bytes(file.data(),  0, 1, 'B');
+    set_bytes(file.data(),  1, 1, 'M');
+    set_bytes(file.data(),  2, 4, HEADER_SIZE + array_bytes);
+    set_bytes(file.data(), 10, 4, HEADER_SIZE);
+    set_bytes(file.data(), 14, 4, 108);
+    set_bytes(file.data(), 18, 4, image.width);
+    set_bytes(file.data(), 22, 4, image.height);
+    set_bytes(file.data(), 26, 2, 1);
+    set_bytes(file.data(), 28, 2, 32);
+    set_bytes(file.data(), 30, 4, 3);               // BI_BITFIELDS
+    set_bytes(file.data(), 34, 4, array_bytes);
+    set_bytes(file.data(), 38, 4, 2835);
+    set_bytes(file.data(), 42, 4, 2835);
+    set_bytes(file.data(), 54, 4, 0x00FF0000);      // red mask
+    set_bytes(file.data(), 58, 4, 0x0000FF00);      // green mask
+    set_bytes(file.data(), 62, 4, 0x000000FF);      // blue mask
+    set_bytes(file.data(), 66, 4, 0xFF000000);      // alpha mask
+    set_bytes(file.data(), 70, 4, 0x73524742);      // 'sRGB' color space
+
+    for (int row = 0; row < image.height; row++)
+    {
+        const unsigned char* in = image.row(row);
+        unsigned char* out = &file[HEADER_SIZE + (size_t)image.width * 4 * (image.height - 1 - row)];
+        for (int col = 0; col < image.width; col++)
+        {
+            out[4 * col]     = in[4 * col + 2];
+            out[4 * col + 1] = in[4 * col + 1];
+            out[4 * col + 2] = in[4 * col];
+            out[4 * col + 3] = in[4 * col + 3];
+        }
+    }
+    return file;
+}
+
+/**
+ * Description - Encodes an image buffer as a BMP file in memory: 24-bit, or 32-bit with a BITMAPV4HEADER
+ * describing the alpha channel when the buffer has 4 channels
+ * @param image the image buffer
+ * @return the BMP file contents
+ */
+vector<unsigned char> encode_bmp(const Image_Buffer& image)
+{
+    if (image.channels == 4)
+    {
+        return encode_bmp_32(image);
+    }
+
+    PROFILE_STAGE("encode bmp", (long long)image.width * image.height * (image.channels + 3));
+    const int HEADER_SIZE = 54;
+    int width_bytes = (image.width * 3 + 3) / 4 * 4;
+    int array_bytes = width_bytes * image.height;
+    vector<unsigned char> file(HEADER_SIZE + (size_t)array_bytes, 0);
+
+    // BMP and DIB headers, same layout as write_image()
+    set_bytes(file.data(),  0, 1, 'B');
+    set_bytes(file.data(),  1, 1, 'M');
+    set_bytes(file.data(),  2, 4, HEADER_SIZE + array_bytes);
+    set_bytes(file.data(), 10, 4, HEADER_SIZE);
+    set_bytes(file.data(), 14, 4, 40);
+    set_bytes(file.data(), 18, 4, image.width);
+    set_bytes(file.data(), 22, 4, image.height);
+    set_bytes(file.data(), 26, 2, 1);
+    set_bytes(file.data(), 28, 2, 24);
+    set_bytes(file.data(), 34, 4, array_bytes);
+    set_bytes(file.data(), 38, 4, 2835);
+    set_bytes(file.data(), 42, 4, 2835);
+
+    for (int row = 0; row < image.height; row++)
+    {
+        const unsigned char* in = image.row(row);
+        unsigned char* out = &file[HEADER_SIZE + (size_t)width_bytes * (image.height - 1 - row)];
+        for (int col = 0; col < image.width; col++)
+        {
+            out[3 * col]     = in[image.channels * col + 2];
+            out[3 * col + 1] = in[image.channels * col + 1];
+            out[3 * col + 2] = in[image.channels * col];
+        }
+    }
+    return file;
+}
+
+/**
+ * Description - Reads a 24 or 32-bit BMP image into a contiguous buffer. The whole file is read with a single
+ * call instead of one seek per pixel like read_image().
+ * @param filename BMP image filename
+ * @param image    the image buffer to fill in
+ * @return True if successful and false otherwise
+ */
+bool read_image_fast(string filename, Image_Buffer& image)
+{
+    vector<unsigned char> file;
+    return read_file(filename, file) && decode_bmp(file, image);
+}
+
+/**
+ * Description - Writes an image buffer to a BMP file, 32-bit when the buffer has an alpha channel and 24-bit
+ * otherwise. The file is built in memory and written with a single call.
+ * @param filename The BMP file name to save the image to
+ * @param image    The image buffer to save
+ * @return True if successful and false otherwise
+ */
+bool write_image_fast(string filename, const Image_Buffer& image)
+{
+    return write_file(filename, encode_bmp(image));
+}
+
+/**
+ * Description - Reads a BMP image for the menu filters with the checked fast decoder instead of read_image()
+ * @param filename BMP image filename
+ * @return the image as a vector of vector of Pixels, or an empty vector if it could not be read
+ */
+vector<vector<Pixel>> load_image(string filename)
+{
+    Image_Buffer image;
+    if (!read_image_fast(filename, image))
+    {
+        return {};
+    }
+    return buffer_to_pixels(image);
+}
+
+/**
+ * Description - Number of worker threads used by the parallel code paths. The IMAGE_THREADS environment
+ * variable overrides the default of one thread per hardware thread.
+ * @return the number of worker threads (at least 1)
+ */
+int worker_count()
+{
+    static int count = []()
+    {
+        const char* setting = getenv("IMAGE_THREADS");
+        int threads = setting != nullptr ? atoi(setting) : (int)thread::hardware_concurrency();
+        return max(threads, 1);
+    }();
+    return count;
+}
+
+// True on the threads owned by the worker pool, so nested parallel_rows() calls run inline
+thread_local bool inside_pool_worker = false;
+
+/**
+ * Description - Fixed set of worker threads that stay alive between jobs. Every job is split into at most one
+ * task per worker and task t always runs on worker t.
+ */
+class Thread_Pool
+{
+public:
+    explicit Thread_Pool(int num_threads)
+    {
+        for (int t = 0; t < num_threads; t++)
+        {
+            workers.emplace_back([this, t]() { worker_loop(t); });
+        }
+    }
+
+    ~Thread_Pool()
+    {
+        {
+            lock_guard<mutex> lock(state_lock);
+            stopping = true;
+        }
+        wake.notify_all();
+        for (thread& worker : workers)
+        {
+            worker.join();
+        }
+    }
+
+    int size() const { return workers.size(); }
+
+    /**
+     * Description - Runs task(0) ... task(num_tasks - 1) on the workers and waits for all of them.
+     * Jobs submitted from several threads at once are run one after the other. If a task throws (out of memory),
+     * the other tasks still finish and the first exception is rethrown here, on the submitting thread.
+     * @param num_tasks number of tasks, at most size()
+     * @param task      function called with the task index
+     */
+    void run(int num_tasks, const function<void(int)>& task)
+    {
+        lock_guard<mutex> one_job_at_a_time(run_lock);
+        unique_lock<mutex> lock(state_lock);
+        job = &task;
+        job_tasks = num_tasks;
+        remaining = num_tasks;
+        failure = nullptr;
+        generation++;
+        wake.notify_all();
+        done.wait(lock, [this]() { return remaining == 0; });
+        job = nullptr;
+        if (failure)
+        {
+            exception_ptr thrown = failure;
+            failure = nullptr;
+            rethrow_exception(thrown);
+        }
+    }
+
+private:
+    void worker_loop(int index)
+    {
+        inside_pool_worker = true;
+        if (pin_workers)
+        {
+            pin_to_cpu(index);
+        }
+#ifdef IMAGE_PROFILE
+        profile_thread_start();
+#endif
+        long long seen = 0;
+        while (true)
+        {
+            const function<void(int)>* task = nullptr;
+            {
+                unique_lock<mutex> lock(state_lock);
+                wake.wait(lock, [&]() { return stopping || generation != seen; });
+                if (stopping)
+                {
+                    return;
+                }
+                seen = generation;
+                if (index >= job_tasks)
+                {
+                    continue;
+                }
+                task = job;
+            }
+
+            exception_ptr thrown;
+            try
+            {
+                (*task)(index);
+            }
+            catch (...)
+            {
+                thrown = current_exception();
+            }
+
+            lock_guard<mutex> lock(state_lock);
+            if (thrown && !failure)
+            {
+                failure = thrown;
+            }
+            if (--remaining == 0)
+            {
+                done.notify_one();
+            }
+        }
+    }
+
+    vector<thread> workers;
+    mutex run_lock;
+    mutex state_lock;
+    condition_variable wake;
+    condition_variable done;
+    const function<void(int)>* job = nullptr;
+    int job_tasks = 0;
+    int remaining = 0;
+    exception_ptr failure;      // first exception thrown by a task of the current job
+    long long generation = 0;
+    bool stopping = false;
+};
+
+/**
+ * Description - The shared worker pool, started the first time it is needed
+ * @return the worker pool
+ */
+Thread_Pool& worker_pool()
+{
+    static Thread_Pool pool(worker_count());
+    return pool;
+}
+
+/**
+ * Description - Splits the rows [0, num_rows) into one contiguous block per worker thread and runs body on each block.
+ * Worker t always gets the t-th block so the same rows land on the same thread from call to call.
+ * @param num_rows number of rows to process
+ * @param body     function called as body(first_row, end_row)
+ */
+void parallel_rows(int num_rows, const function<void(int, int)>& body)
+{
+    int num_threads = min(worker_count(), num_rows);
+    if (num_threads <= 1 || inside_pool_worker)
+    {
+        body(0, num_rows);
+        return;
+    }
+
+    worker_pool().run(num_threads, [&](int t)
+    {
+        int first_row = (long long)num_rows * t / num_threads;
+        int end_row = (long long)num_rows * (t + 1) / num_threads;
+        body(first_row, end_row);
+    });
+}
+
+/**
+ * Description - Runs work several times and returns the fastest run
+ * @param work    the work to time
+ * @param repeats number of runs
+ * @return the fastest run in milliseconds
+ */
+double time_ms(const function<void()>& work, int repeats)
+{
+    double best = 1e300;
+    for (int i = 0; i < repeats; i++)
+    {
+        auto start = chrono::steady_clock::now();
+        work();
+        auto end = chrono::steady_clock::now();
+        best = min(best, chrono::duration<double, milli>(end - start).count());
+    }
+    return best;
+}
+
+/**
+ * Description - Creates a deterministic test image (gradients plus noise) for benchmarks
+ * @param width  width in pixels
+ * @param height height in pixels
+ * @return the test image
+ */
+Image_Buffer make_test_image(int width, int height)
+{
+    Image_Buffer image = make_buffer(width, height);
+    unsigned int seed = 12345;
+    for (int row = 0; row < height; row++)
+    {
+        unsigned char* out = image.row(row);
+        for (int col = 0; col < width; col++)
+        {
+            seed = seed * 1103515245 + 12345;
+            int noise = (seed >> 16) % 32;
+            out[3 * col]     = (col * 255 / max(1, width - 1) + noise) % 256;
+            out[3 * col + 1] = (row * 255 / max(1, height - 1) + noise) % 256;
+            out[3 * col + 2] = ((col + row) * 255 / max(1, width + height - 2) + noise) % 256;
+        }
+    }
+    return image;
+}
+
+//
+// COLOR CONVERSION
+//
+// All conversions use 16-bit fixed point integer math. Each row function is a template on the number of channels
+// (3 or 4) behind a wrapper taking it at run time: with the stride fixed, the straight, branch free loops are
+// vectorized by g++ -O3. The luma and HSV to RGB rows vectorize on any x86-64; the others need 32-bit vector
+// multiplies, which on x86 means -msse4.1 or later (for example -march=native).
+//
+
+// Luma formulas offered by the grayscale and high contrast filters
+enum Luma_Standard
+{
+    Luma_Average = 0,   // (red + green + blue) / 3, the original grayscale formula
+    Luma_BT601,         // 0.299 R + 0.587 G + 0.114 B
+    Luma_BT709          // 0.2126 R + 0.7152 G + 0.0722 B
+};
+
+// Red, green and blue weights and the rounding term for each Luma_Standard, scaled by 65536.
+// 21846 / 65536 with no rounding gives exactly (red + green + blue) / 3 for every 8-bit input.
+const int LUMA_WEIGHTS[3][4] =
+{
+    {21846, 21846, 21846, 0},
+    {19595, 38470,  7471, 32768},
+    {13933, 46871,  4732, 32768}
+};
+
+/**
+ * Description - Luma of one pixel
+ * @param red      the red value
+ * @param green    the green value
+ * @param blue     the blue value
+ * @param standard the Luma_Standard
+ * @return the luma, 0-255
+ */
+inline int luma(int red, int green, int blue, int standard)
+{
+    const int* weights = LUMA_WEIGHTS[standard];
+    return (weights[0] * red + weights[1] * green + weights[2] * blue + weights[3]) >> 16;
+}
+
+template <int CHANNELS>
+void rgb_to_luma_row(const unsigned char* rgb, unsigned char* out, int count, int standard)
+{
+    const int* weights = LUMA_WEIGHTS[standard];
+    for (int i = 0; i < count; i++)
+    {
+        const unsigned char* pixel = rgb + i * CHANNELS;
+        out[i] = (weights[0] * pixel[0] + weights[1] * pixel[1] + weights[2] * pixel[2] + weights[3]) >> 16;
+    }
+}
+
+/**
+ * Description - Luma of a row of pixels
+ * @param rgb      the input pixels (red, green, blue first in each pixel)
+ * @param channels number of channels per input pixel
+ * @param out      the luma values
+ * @param count    number of pixels
+ * @param standard the Luma_Standard
+ */
+void rgb_to_luma_row(const unsigned char* rgb, int channels, unsigned char* out, int count, int standard)
+{
+    if (channels == 4)
+    { rgb_to_luma_row<4>(rgb, out, count, standard); }
+    else
+    { rgb_to_luma_row<3>(rgb, out, count, standard); }
+}
+
+/**
+ * Description - Clamps a value to 0-255
+ * @param value the value
+ * @return the clamped value
+ */
+inline int clamp_byte(int value)
+{
+    return value < 0 ? 0 : (value > 255 ? 255 : value);
+}
+
+template <int CHANNELS>
+void rgb_to_ycbcr_row(const unsigned char* rgb, unsigned char* ycbcr, int count)
+{
+    for (int i = 0; i < count; i++)
+    {
+        int red = rgb[i * CHANNELS];
+        int green = rgb[i * CHANNELS + 1];
+        int blue = rgb[i * CHANNELS + 2];
+        ycbcr[3 * i]     = (19595 * red + 38470 * green + 7471 * blue + 32768) >> 16;
+        ycbcr[3 * i + 1] = clamp_byte((-11059 * red - 21709 * green + 32768 * blue + (128 << 16) + 32768) >> 16);
+        ycbcr[3 * i + 2] = clamp_byte((32768 * red - 27439 * green - 5329 * blue + (128 << 16) + 32768) >> 16);
+    }
+}
+
+/**
+ * Description - Converts a row of pixels to full range BT.601 YCbCr (the JPEG convention)
+ * @param rgb      the input pixels
+ * @param channels number of channels per input pixel
+ * @param ycbcr    the output pixels, interleaved Y, Cb, Cr
+ * @param count    number of pixels
+ */
+void rgb_to_ycbcr_row(const unsigned char* rgb, int channels, unsigned char* ycbcr, int count)
+{
+    if (channels == 4)
+    { rgb_to_ycbcr_row<4>(rgb, ycbcr, count); }
+    else
+    { rgb_to_ycbcr_row<3>(rgb, ycbcr, count); }
+}
+
+template <int CHANNELS>
+void ycbcr_to_rgb_row(const unsigned char* ycbcr, unsigned char* rgb, int count)
+{
+    for (int i = 0; i < count; i++)
+    {
+        int y = ycbcr[3 * i] << 16;
+        int cb = ycbcr[3 * i + 1] - 128;
+        int cr = ycbcr[3 * i + 2] - 128;
+        rgb[i * CHANNELS]     = clamp_byte((y + 91881 * cr + 32768) >> 16);
+        rgb[i * CHANNELS + 1] = clamp_byte((y - 22554 * cb - 46802 * cr + 32768) >> 16);
+        rgb[i * CHANNELS + 2] = clamp_byte((y + 116130 * cb + 32768) >> 16);
+    }
+}
+
+/**
+ * Description - Converts a row of full range BT.601 YCbCr pixels back to red, green, blue
+ * @param ycbcr    the input pixels, interleaved Y, Cb, Cr
+ * @param rgb      the output pixels
+ * @param channels number of channels per output pixel (only red, green and blue are written)
+ * @param count    number of pixels
+ */
+void ycbcr_to_rgb_row(const unsigned char* ycbcr, unsigned char* rgb, int channels, int count)
+{
+    if (channels == 4)
+    { ycbcr_to_rgb_row<4>(ycbcr, rgb, count); }
+    else
+    { ycbcr_to_rgb_row<3>(ycbcr, rgb, count); }
+}
+
+// Hue is stored as 0-1535: six 256-step sectors starting at red
+const int HUE_RANGE = 6 * 256;
+
+// Reciprocals 65536 / n (rounded) for n = 1-255, used instead of per-pixel division. Entry 0 is unused.
+struct Reciprocal_Table
+{
+    unsigned int values[256];
+
+    Reciprocal_Table()
+    {
+        values[0] = 0;
+        for (int n = 1; n < 256; n++)
+        {
+            values[n] = (65536 + n / 2) / n;
+        }
+    }
+};
+const Reciprocal_Table RECIPROCALS;
+
+template <int CHANNELS>
+void rgb_to_hsv_row(const unsigned char* rgb, unsigned short* hue, unsigned char* saturation, unsigned char* value, int count)
+{
+    const unsigned int* reciprocal = RECIPROCALS.values;
+    for (int i = 0; i < count; i++)
+    {
+        int red = rgb[i * CHANNELS];
+        int green = rgb[i * CHANNELS + 1];
+        int blue = rgb[i * CHANNELS + 2];
+        int high = max(red, max(green, blue));
+        int low = min(red, min(green, blue));
+        int chroma = high - low;
+
+        // Sector base and the signed difference that moves the hue within it
+        int base = high == red ? 0 : (high == green ? 512 : 1024);
+        int difference = high == red ? green - blue : (high == green ? blue - red : red - green);
+        int offset = ((int)(abs(difference) * reciprocal[chroma]) + 128) >> 8;
+        int h = base + (difference < 0 ? -offset : offset);
+
+        hue[i] = chroma == 0 ? 0 : (h < 0 ? h + HUE_RANGE : h);
+        saturation[i] = (chroma * 255 * reciprocal[high] + 32768) >> 16;
+        value[i] = high;
+    }
+}
+
+/**
+ * Description - Converts a row of pixels to hue (0-1535), saturation (0-255) and value (0-255)
+ * @param rgb        the input pixels
+ * @param channels   number of channels per input pixel
+ * @param hue        the output hues
+ * @param saturation the output saturations
+ * @param value      the output values
+ * @param count      number of pixels
+ */
+void rgb_to_hsv_row(const unsigned char* rgb, int channels, unsigned short* hue, unsigned char* saturation, unsigned char* value, int count)
+{
+    if (channels == 4)
+    { rgb_to_hsv_row<4>(rgb, hue, saturation, value, count); }
+    else
+    { rgb_to_hsv_row<3>(rgb, hue, saturation, value, count); }
+}
+
+template <int CHANNELS>
+void hsv_to_rgb_row(const unsigned short* hue, const unsigned char* saturation, const unsigned char* value, unsigned char* rgb, int count)
+{
+    for (int i = 0; i < count; i++)
+    {
+        int v = value[i];
+        int chroma = (saturation[i] * v * 257 + 32896) >> 16;
+        int sector = hue[i] >> 8;
+        int fraction = hue[i] & 255;
+        int rising = (chroma * fraction + 128) >> 8;
+        int falling = chroma - rising;
+        int low = v - chroma;
+
+        // Each sector holds one channel at the top (low + chroma), one at the bottom and one moving between them.
+        // The sector tests multiply instead of select so the loop has no branches.
+        int red = low + chroma * ((sector == 0) | (sector == 5)) + falling * (sector == 1) + rising * (sector == 4);
+        int green = low + chroma * ((sector == 1) | (sector == 2)) + rising * (sector == 0) + falling * (sector == 3);
+        int blue = low + chroma * ((sector == 3) | (sector == 4)) + rising * (sector == 2) + falling * (sector == 5);
+        rgb[i * CHANNELS] = red;
+        rgb[i * CHANNELS + 1] = green;
+        rgb[i * CHANNELS + 2] = blue;
+    }
+}
+
+/**
+ * Description - Converts a row of hue, saturation, value pixels back to red, green, blue
+ * @param hue        the input hues (0-1535)
+ * @param saturation the input saturations
+ * @param value      the input values
+ * @param rgb        the output pixels
+ * @param channels   number of channels per output pixel (only red, green and blue are written)
+ * @param count      number of pixels
+ */
+void hsv_to_rgb_row(const unsigned short* hue, const unsigned char* saturation, const unsigned char* value, unsigned char* rgb, int channels, int count)
+{
+    if (channels == 4)
+    { hsv_to_rgb_row<4>(hue, saturation, value, rgb, count); }
+    else
+    { hsv_to_rgb_row<3>(hue, saturation, value, rgb, count); }
+}
+
+/**
+ * Description - Asks the user for a luma formula
+ * @return the Luma_Standard
+ */
+int luma_standard_selection()
+{
+    int standard = Luma_Average;
+    cout << "Enter gray formula (0 = average, 1 = BT.601, 2 = BT.709): ";
+    cin >> standard;
+    if (standard != Luma_BT601 && standard != Luma_BT709)
+    {
+        standard = Luma_Average;
+    }
+    return standard;
+}
+
+/**
+ * Description - Displays the program's introduction message
+ */
+void intro_message()
+{
+    cout << endl << "CSPB 1300 Image Processing Application" << endl;
+}
+
+/**
+ * Description - Displays menu selection and prompts user to make selection
+ * @return the user's menu selection as an int
+ */
+int menu_selection()
+{
+    int selection;
+    cout << endl << "----------------------------------" << endl;
+    cout << "IMAGE PROCESSING MENU" << endl;
+    cout << "0) Change image (current: sample.bmp)" << endl;
+    cout << "1) Vignette" << endl;
+    cout << "2) Clarendon" << endl;
+    cout << "3) Grayscale" << endl;
+    cout << "4) Rotate 90 degrees" << endl;
+    cout << "5) Rotate multiple 90 degrees" << endl;
+    cout << "6) Enlarge" << endl;
+    cout << "7) High contrast" << endl;
+    cout << "8) Lighten" << endl;
+    cout << "9) Darken" << endl;
+    cout << "10) Black, white, red, green, blue" << endl;
+    cout << "11) Thumbnail pyramid" << endl;
+    cout << "12) Saturation" << endl;
+    cout << "13) Hue shift" << endl;
+    cout << "14) Flip or transpose" << endl;
+    cout << "15) Rotate by any angle" << endl;
+    cout << "16) Tune Clarendon, lighten or darken" << endl;
+    cout << "17) Composite an overlay" << endl;
+    cout << "18) Median denoise" << endl;
+    cout << "19) Bilateral denoise" << endl;
+    cout << "----------------------------------" << endl;
+
+    cout << endl << "Enter menu selection (Q to quit): "; // Good
+    cin >> selection;
+    cout << endl;
+    
+    return selection;
+}
+
+/**
+ * Description - Sets the input filename from the user's input
+ * @return the name of the initial input filename as a string
+ */
+string initial_input_filename()
+{
+    string initial_filename;
+    cout << "Enter input BMP filename: "; // Good
+    cin >> initial_filename;
+    return initial_filename;
+}
+
+/**
+ * Description - Changes the input filename from the user's input. 
+ * @return the name of the new input filename as a string
+ */
+string process_0()
+{
+    string new_filename;
+    cout << "Change Image selected" << endl;
+    cout << "Enter new input BMP filename: " << endl;
+    cin >> new_filename; 
+    cout << "Successfully changed input image!" << endl;
+    return new_filename;
+}
+
+/**
+ * Description - Adds vignette effect to image (dark corners)
+ * @param filename BMP image filename
+ * @return the image as a vector of vector of Pixels
+ */
+vector<vector<Pixel>> process_1(const vector<vector<Pixel>>& image)
+{    
+    PROFILE_STAGE("process_1", (long long)image.size() * image[0].size() * sizeof(Pixel) * 2);
+    int num_rows = image.size(); // Gets the number of rows (height) in a 2D vector named image.
+    int num_cols = image[0].size(); // Gets the number of columns (i.e.) in a 2D vector named image.
+
+    vector<vector<Pixel>> new_new_image(num_rows, vector<Pixel> (num_cols));
+
+    for (int row = 0; row < num_rows; row++)
+    {
+        for (int col = 0; col < num_cols; col++)
+        {
+            // find the distance to the center
+            double distance = sqrt( pow((col - num_rows / 2),2) + pow((row - num_cols / 2),2));
+            double scaling_factor = (num_cols - distance) / num_cols;
+            
+            int red_color = image[row][col].red;
+            int green_color = image[row][col].green;
+            int blue_color = image[row][col].blue;
+
+            new_new_image[row][col].red   = red_color   * scaling_factor;
+            new_new_image[row][col].green = green_color * scaling_factor;
+            new_new_image[row][col].blue  = blue_color  * scaling_factor;
+        }
+    }
+    return new_new_image;
+}
+
+/**
+ * Description - Process 1 Wrapper function. Takes input filename, calls read_image functions to transform the image into a vector,
+ * calls process_1 function to apply Vignette, calls write_image fucntion to transform the new vector into a .bmp file, and prints success,
+ * if the image transformation was successful.
+ * @param input_filename BMP image filename
+ */
+void process_1_wrapper(string input_filename)
+{
+    string output_filename = "";
+    vector<vector<Pixel>> image;
+    vector<vector<Pixel>> new_image;
+    bool success = true;
+
+    cout << "Vignette selected" << endl;
+    cout << "Enter output BMP filename: ";
+    cin >> output_filename;                
+
+    image = load_image(input_filename);
+    if (image.empty())
+    { cout << "Process 1 failed: could not read " << input_filename << endl; return; }
+    new_image = process_1(image); 
+    success = write_image(output_filename, new_image);
+    
+    if (success == true)
+    { cout << "Successfully applied Vignette!" << endl; }
+    else
+    { cout << "Process 1 failed" << endl; } 
+}
+
+/**
+ * Status == working, needs clean up
+ * Description - Adds Clarendon effect to image (darks darker and lights lighter) by a scaling factor
+ * @param filename BMP image filename
+ * @return the image as a vector of vector of Pixels
+ */
+vector<vector<Pixel>> process_2(const vector<vector<Pixel>>& image, double scaling_factor)
+{    
+    PROFILE_STAGE("process_2", (long long)image.size() * image[0].size() * sizeof(Pixel) * 2);
+    int num_rows = image.size(); 
+    int num_cols = image[0].size(); 
+
+    vector<vector<Pixel>> new_new_image(num_rows, vector<Pixel> (num_cols));
+
+    for (int row = 0; row < num_rows; row++)
+    {
+        for (int col = 0; col < num_cols; col++)
+        {          
+            int red_color = image[row][col].red;
+            int green_color = image[row][col].green;
+            int blue_color = image[row][col].blue;
+
+            int average_value = luma(red_color, green_color, blue_color, Luma_Average);
+
+            if (average_value >= 170)
+            {
+                new_new_image[row][col].red   = (255 - (255 - red_color)   * scaling_factor);
+                new_new_image[row][col].green = (255 - (255 - green_color) * scaling_factor);
+                new_new_image[row][col].blue  = (255 - (255 - blue_color)  * scaling_factor);
+            }
+            else if (average_value < 90)
+            {
+                new_new_image[row][col].red   = red_color   * scaling_factor;
+                new_new_image[row][col].green = green_color * scaling_factor;
+                new_new_image[row][col].blue  = blue_color  * scaling_factor;
+            }
+            else
+            {
+                new_new_image[row][col].red   = red_color;
+                new_new_image[row][col].green = green_color;
+                new_new_image[row][col].blue  = blue_color;
+            }
+        }
+    }
+    return new_new_image;
+}
+
+/**
+ * Description - Process 2 Wrapper function. Takes input filename, calls read_image functions to transform the image into a vector,
+ * calls process_2 function to apply Clarendon, calls write_image fucntion to transform the new vector into a .bmp file, and prints success,
+ * if the image transformation was successful.
+ * @param input_filename BMP image filename
+ */
+void process_2_wrapper(string input_filename)
+{
+    string output_filename = "";
+    vector<vector<Pixel>> image;
+    vector<vector<Pixel>> new_image;
+    double scaling_factor = 1;
+    bool success = true;
+    
+    cout << "Clarendon selected" << endl;
+    cout << "Enter output BMP filename: ";
+    cin >> output_filename;
+    cout << "Enter scaling factor: "; // Use 0.3
+    cin >> scaling_factor;
+    
+    image = load_image(input_filename);
+    if (image.empty())
+    { cout << "Process 2 failed: could not read " << input_filename << endl; return; }
+    new_image = process_2(image, scaling_factor);
+    success = write_image(output_filename, new_image);
+    
+    if (success == true)
+    { cout << "Successfully applied Clarendon!" << endl; }
+    else
+    { cout << "Process 2 failed" << endl; }
+}
+
+/**
+ * Status == working, needs clean up
+ * Description - Grayscale image
+ * @param filename BMP image filename
+ * @param standard the Luma_Standard used for the gray value
+ * @return the image as a vector of vector of Pixels
+ */
+vector<vector<Pixel>> process_3(const vector<vector<Pixel>>& image, int standard = Luma_Average)
+{    
+    PROFILE_STAGE("process_3", (long long)image.size() * image[0].size() * sizeof(Pixel) * 2);
+    int num_rows = image.size();
+    int num_cols = image[0].size();
+
+    vector<vector<Pixel>> new_new_image(num_rows, vector<Pixel> (num_cols));
+
+    for (int row = 0; row < num_rows; row++)
+    {
+        for (int col = 0; col < num_cols; col++)
+        {         
+            int red_color = image[row][col].red;
+            int green_color = image[row][col].green;
+            int blue_color = image[row][col].blue;
+            int gray_value = luma(red_color, green_color, blue_color, standard);
+
+            new_new_image[row][col].red   = gray_value;
+            new_new_image[row][col].green = gray_value;
+            new_new_image[row][col].blue  = gray_value;
+        }
+    }
+    return new_new_image;
+}
+
+/**
  * Description - Process 3 Wrapper function. Takes input filename, calls read_image functions to transform the image into a vector,
  * calls process_3 function to apply Grayscale, calls write_image fucntion to transform the new vector into a .bmp file, and prints success,
  * if the image transformation was successful.
  * @param input_filename BMP image filename
  */
-void process_3_wrapper(string input_filename)
+void process_3_wrapper(string input_filename)
+{
+    string output_filename = "";
+    vector<vector<Pixel>> image;
+    vector<vector<Pixel>> new_image;
+    double scaling_factor = 1;
+    bool success = true;
+
+    cout << "Grayscale selected" << endl;
+    cout << "Enter output BMP filename: ";
+    cin >> output_filename;
+    int standard = luma_standard_selection();
+    
+    image = load_image(input_filename);
+    if (image.empty())
+    { cout << "Process 3 failed: could not read " << input_filename << endl; return; }
+    new_image = process_3(image, standard);
+    success = write_image(output_filename, new_image);
+    
+    if (success == true)
+    {cout << "Successfully applied GrayScale!" << endl;}
+    else
+    {cout << "Process 3 failed" << endl;}
+}
+
+/**
+ * Status == working, needs clean up
+ * Description - Rotates image by 90 degrees clockwise (not counter-clockwise)
+ * @param filename BMP image filename
+ * @return the image as a vector of vector of Pixels
+ */
+vector<vector<Pixel>> process_4(const vector<vector<Pixel>>& image)
+{    
+    PROFILE_STAGE("process_4", (long long)image.size() * image[0].size() * sizeof(Pixel) * 2);
+    int num_rows = image.size();
+    int num_cols = image[0].size();
+
+    // Invert the rows and cols for new_new_image and the nested for loops
+    vector<vector<Pixel>> new_new_image(num_cols, vector<Pixel> (num_rows));
+
+    for (int col = 0; col < num_cols; col++)
+    {
+        for (int row = 0; row < num_rows; row++)
+        {    
+            int red_color = image[row][col].red;
+            int green_color = image[row][col].green;
+            int blue_color = image[row][col].blue;
+
+            new_new_image[col][(num_rows - 1) - row].red   = red_color;
+            new_new_image[col][(num_rows - 1) - row].green = green_color;
+            new_new_image[col][(num_rows - 1) - row].blue  = blue_color;
+        }
+    }
+    return new_new_image;
+}
+
+/**
+ * Description - Process 4 Wrapper function. Takes input filename, calls read_image functions to transform the image into a vector,
+ * calls process_4 function to apply Rotate 90 Degrees, calls write_image fucntion to transform the new vector into a .bmp file, and prints success,
+ * if the image transformation was successful.
+ * @param input_filename BMP image filename
+ */
+void process_4_wrapper(string input_filename)
+{
+    string output_filename = "";
+    vector<vector<Pixel>> image;
+    vector<vector<Pixel>> new_image;
+    double scaling_factor = 1;
+    bool success = true;
+
+    cout << "Rotate 90 degrees selected" << endl;
+    cout << "Enter output BMP filename: ";
+    cin >> output_filename;
+    
+    image = load_image(input_filename);
+    if (image.empty())
+    { cout << "Process 4 failed: could not read " << input_filename << endl; return; }
+    new_image = process_4(image); 
+    success = write_image(output_filename, new_image);
+    
+    if (success == true)
+    {cout << "Successfully applied 90 degree rotation!" << endl;}
+    else
+    {cout << "Process 4 failed" << endl;}   
+}
+
+/**
+ * Description - Reduces a number of clockwise 90 degree rotations to 0-3, so -1 turns the same way as 3
+ * @param rotations the number of rotations (truncated to a whole number)
+ * @return the number of rotations from 0 to 3, or 0 if it is not finite
+ */
+int quarter_turns(double rotations)
+{
+    if (!isfinite(rotations))
+    {
+        return 0;
+    }
+    return ((int)fmod(trunc(rotations), 4) + 4) % 4;
+}
+
+/**
+ * IN WORK
+ * Description - Rotates image by a specified number of multiples of 90 degrees clockwise
+ * @param filename BMP image filename
+ * @return the image as a vector of vector of Pixels
+ */
+vector<vector<Pixel>> process_5(const vector<vector<Pixel>>& image, int number)
+{
+    int angle = quarter_turns(number) * 90;
+    //cout << "the angle is: " << angle << endl;;
+    
+    if (angle % 360 == 0)
+        { return image; }
+    else if (angle % 360 == 90)
+        { return process_4(image); }
+    else if (angle % 360 == 180)
+        { return process_4(process_4(image)); }
+    else
+        { return process_4(process_4(process_4(image))); }
+}
+
+/**
+ * Description - Process 5 Wrapper function. Takes input filename, calls read_image functions to transform the image into a vector,
+ * calls process_5 function to apply Multiple 90 degree rotation, calls write_image fucntion to transform the new vector into a .bmp file, and prints success,
+ * if the image transformation was successful.
+ * @param input_filename BMP image filename
+ */
+void process_5_wrapper(string input_filename)
+{
+    string output_filename = "";
+    vector<vector<Pixel>> image;
+    vector<vector<Pixel>> new_image;
+    double scaling_factor = 1;
+    bool success = true;
+    int num_90_degree_rotations = 0;
+
+    cout << "Process multiple 90 degrees selected" << endl;
+    
+    cout << "Enter output BMP filename: ";
+    cin >> output_filename;
+    cout << "Enter number of 90 degree rotations: ";
+    cin >> num_90_degree_rotations;
+    
+    image = load_image(input_filename);
+    if (image.empty())
+    { cout << "Process 5 failed: could not read " << input_filename << endl; return; }
+    new_image = process_5(image, num_90_degree_rotations); 
+    success = write_image(output_filename, new_image);
+    
+    if (success == true)
+    {cout << "Successfully applied multiple 90 degree rotations!" << endl;}
+    else
+    {cout << "Process 5 failed" << endl;}
+}
+
+/**
+ * IN WORK
+ * Description - Enlarges the image in the x and y direction
+ * @param filename BMP image filename
+ * @return the image as a vector of vector of Pixels
+ */
+vector<vector<Pixel>> process_6(const vector<vector<Pixel>>& image, int x_scale, int y_scale)
+{   
+    PROFILE_STAGE("process_6", (long long)image.size() * image[0].size() * sizeof(Pixel) * (1 + x_scale * y_scale));
+    int num_rows = image.size(); 
+    int num_cols = image[0].size(); 
+
+    vector<vector<Pixel>> new_new_image(num_rows * y_scale, vector<Pixel> (num_cols * x_scale));
+
+    for (int row = 0; row < num_rows * y_scale; row++)
+    {
+        for (int col = 0; col < num_cols * x_scale; col++)
+        {         
+            int red_color = image[row/y_scale][col / x_scale].red;
+            int green_color = image[row/y_scale][col / x_scale].green;
+            int blue_color = image[row/y_scale][col / x_scale].blue;
+
+            new_new_image[row][col].red   = red_color;
+            new_new_image[row][col].green = green_color;
+            new_new_image[row][col].blue  = blue_color;
+        }
+    }
+    return new_new_image;
+}
+
+/**
+ * Description - Process 6 Wrapper function. Takes input filename, calls read_image functions to transform the image into a vector,
+ * calls process_6 function to apply Enlarge, calls write_image fucntion to transform the new vector into a .bmp file, and prints success,
+ * if the image transformation was successful.
+ * @param input_filename BMP image filename
+ */
+void process_6_wrapper(string input_filename)
+{
+    string output_filename = "";
+    vector<vector<Pixel>> image;
+    vector<vector<Pixel>> new_image;
+    double scaling_factor = 1;
+    bool success = true;
+    int x_scale = 1; 
+    int y_scale = 1; 
+
+    cout << "Enlarge selected" << endl;
+    cout << "Enter output BMP filename: ";
+    cin >> output_filename;
+    cout << "Enter X scale: ";
+    cin >> x_scale;
+    cout << "Enter Y scale: ";
+    cin >> y_scale;
+    
+    image = load_image(input_filename);
+    if (image.empty())
+    { cout << "Process 6 failed: could not read " << input_filename << endl; return; }
+    new_image = process_6(image, x_scale, y_scale);
+    success = write_image(output_filename, new_image);
+    
+    if (success == true){cout << "Successfully enlarged!" << endl;}
+    else{cout << "Process 7 failed" << endl;}  
+}
+
+//
+// DITHERING
+//
+
+// Dither modes offered by the high contrast and 5-color quantizers
+enum Dither_Mode
+{
+    No_Dither = 0,      // Hard per-pixel threshold (the original behavior)
+    Floyd_Steinberg,    // Error diffusion
+    Ordered_Bayer       // 8x8 Bayer threshold matrix
+};
+
+// 8x8 Bayer matrix, values 0-63
+const unsigned char BAYER_8X8[8][8] =
+{
+    { 0, 32,  8, 40,  2, 34, 10, 42},
+    {48, 16, 56, 24, 50, 18, 58, 26},
+    {12, 44,  4, 36, 14, 46,  6, 38},
+    {60, 28, 52, 20, 62, 30, 54, 22},
+    { 3, 35, 11, 43,  1, 33,  9, 41},
+    {51, 19, 59, 27, 49, 17, 57, 25},
+    {15, 47,  7, 39, 13, 45,  5, 37},
+    {63, 31, 55, 23, 61, 29, 53, 21}
+};
+
+/**
+ * Description - Ordered dither offset for a pixel position, spread evenly over about -128 to 128
+ * @param row the pixel row
+ * @param col the pixel column
+ * @return the offset to add before quantizing
+ */
+inline int bayer_offset(int row, int col)
+{
+    return BAYER_8X8[row & 7][col & 7] * 4 + 2 - 128;
+}
+
+/**
+ * Description - Quantizes one pixel for the high contrast filter, same threshold as process_7
+ * @param gray the gray value (may be outside 0-255 after adding dither offsets or errors)
+ * @return 255 or 0
+ */
+inline int high_contrast_level(int gray)
+{
+    return gray >= 255 / 2 ? 255 : 0;
+}
+
+/**
+ * Description - Quantizes one pixel to black, white, red, green or blue, same rules as process_10
+ * @param red   the red value
+ * @param green the green value
+ * @param blue  the blue value
+ * @param out   the output pixel (red, green, blue)
+ */
+inline void five_color_level(int red, int green, int blue, unsigned char* out)
+{
+    int color_sum = red + green + blue;
+    bool white = color_sum >= 550;
+    bool black = color_sum <= 150;
+    bool is_red = red > green && red > blue;
+    bool is_green = green > red && green > blue;
+    out[0] = white || (!black && is_red) ? 255 : 0;
+    out[1] = white || (!black && !is_red && is_green) ? 255 : 0;
+    out[2] = white || (!black && !is_red && !is_green) ? 255 : 0;
+}
+
+/**
+ * Description - Floyd-Steinberg error diffusion with a wavefront schedule. Rows are dealt out to the workers
+ * round robin (row y goes to worker y % threads). A row may quantize column x once the row above has finished
+ * column x + 1, which is every pixel whose error reaches it, so all rows run at once with a small lag between
+ * them. Progress is published every 64 columns. Errors are kept as sixteenths in a small ring of rows.
+ * @param image          the input image
+ * @param result         the output image (same size)
+ * @param error_channels number of values carrying error per pixel
+ * @param quantize       function called as quantize(row, col, values, out_pixel, quantization_errors), where
+ *                       values holds the pixel plus its diffused error
+ */
+template <typename Quantizer>
+void diffuse_errors(const Image_Buffer& image, Image_Buffer& result, int error_channels, Quantizer quantize)
+{
+    const int BLOCK = 64;
+    int width = image.width;
+    int height = image.height;
+    int num_threads = inside_pool_worker ? 1 : min(worker_count(), height);
+    int ring_rows = num_threads + 2;
+
+    // Error rows have one spare pixel on each side so the edges need no special cases
+    int ring_stride = (width + 2) * error_channels;
+    vector<int> ring((size_t)ring_rows * ring_stride, 0);
+    unique_ptr<atomic<int>[]> progress(new atomic<int>[height]);
+    for (int row = 0; row < height; row++)
+    {
+        progress[row].store(0, memory_order_relaxed);
+    }
+
+    auto task = [&](int t)
+    {
+        vector<int> values(error_channels);
+        vector<int> errors(error_channels);
+        vector<int> carry(error_channels);
+        for (int row = t; row < height; row += num_threads)
+        {
+            unsigned char* out = result.row(row);
+            int* current = &ring[(size_t)(row % ring_rows) * ring_stride + error_channels];
+            int* next = &ring[(size_t)((row + 1) % ring_rows) * ring_stride + error_channels];
+            fill(carry.begin(), carry.end(), 0);
+
+            for (int block_start = 0; block_start < width; block_start += BLOCK)
+            {
+                int block_end = min(width, block_start + BLOCK);
+                if (row > 0 && num_threads > 1)
+                {
+                    int needed = min(width, block_end + 1);
+                    while (progress[row - 1].load(memory_order_acquire) < needed)
+                    {
+                        this_thread::yield();
+                    }
+                }
+
+                for (int col = block_start; col < block_end; col++)
+                {
+                    int* here = current + col * error_channels;
+                    for (int c = 0; c < error_channels; c++)
+                    {
+                        int sixteenths = here[c] + carry[c];
+                        values[c] = sixteenths >= 0 ? (sixteenths + 8) / 16 : -((8 - sixteenths) / 16);
+                        here[c] = 0;
+                    }
+
+                    quantize(row, col, values.data(), out + 3 * col, errors.data());
+
+                    int* below = next + col * error_channels;
+                    for (int c = 0; c < error_channels; c++)
+                    {
+                        carry[c] = 7 * errors[c];
+                        below[c - error_channels] += 3 * errors[c];
+                        below[c] += 5 * errors[c];
+                        below[c + error_channels] += errors[c];
+                    }
+                }
+                progress[row].store(block_end, memory_order_release);
+            }
+
+            // The spare pixels collected error that falls off the image; clear them for the next use of the row
+            for (int c = 0; c < error_channels; c++)
+            {
+                current[c - error_channels] = 0;
+                current[width * error_channels + c] = 0;
+            }
+        }
+    };
+
+    if (num_threads == 1)
+    {
+        task(0);
+    }
+    else
+    {
+        worker_pool().run(num_threads, task);
+    }
+}
+
+/**
+ * Description - High contrast (black and white) quantizer with a choice of dither mode.
+ * No_Dither matches process_7; Ordered_Bayer runs rows in parallel; Floyd_Steinberg uses the wavefront schedule.
+ * @param image    the input image
+ * @param mode     the Dither_Mode
+ * @param standard the Luma_Standard used for the gray value
+ * @return the quantized image
+ */
+Image_Buffer quantize_high_contrast(const Image_Buffer& image, int mode, int standard = Luma_Average)
+{
+    PROFILE_STAGE("quantize high contrast", image.data.size() * 2);
+    Image_Buffer result = make_buffer(image.width, image.height);
+    int channels = image.channels;
+
+    if (mode == Floyd_Steinberg)
+    {
+        diffuse_errors(image, result, 1, [&](int row, int col, const int* values, unsigned char* out, int* errors)
+        {
+            const unsigned char* in = image.row(row) + col * channels;
+            int gray = luma(in[0], in[1], in[2], standard) + values[0];
+            int level = high_contrast_level(gray);
+            out[0] = out[1] = out[2] = level;
+            errors[0] = min(max(gray, 0), 255) - level;
+        });
+        return result;
+    }
+
+    parallel_rows(image.height, [&](int first_row, int end_row)
+    {
+        vector<unsigned char> grays(image.width);
+        for (int row = first_row; row < end_row; row++)
+        {
+            rgb_to_luma_row(image.row(row), channels, grays.data(), image.width, standard);
+            unsigned char* out = result.row(row);
+            for (int col = 0; col < image.width; col++)
+            {
+                int gray = grays[col];
+                if (mode == Ordered_Bayer)
+                {
+                    gray += bayer_offset(row, col);
+                }
+                out[3 * col] = out[3 * col + 1] = out[3 * col + 2] = high_contrast_level(gray);
+            }
+        }
+    });
+    return result;
+}
+
+/**
+ * Description - Black, white, red, green, blue quantizer with a choice of dither mode.
+ * No_Dither matches process_10; Ordered_Bayer runs rows in parallel; Floyd_Steinberg uses the wavefront schedule.
+ * @param image the input image
+ * @param mode  the Dither_Mode
+ * @return the quantized image
+ */
+Image_Buffer quantize_five_colors(const Image_Buffer& image, int mode)
+{
+    PROFILE_STAGE("quantize five colors", image.data.size() * 2);
+    Image_Buffer result = make_buffer(image.width, image.height);
+    int channels = image.channels;
+
+    if (mode == Floyd_Steinberg)
+    {
+        diffuse_errors(image, result, 3, [&](int row, int col, const int* values, unsigned char* out, int* errors)
+        {
+            const unsigned char* in = image.row(row) + col * channels;
+            int color[3];
+            for (int c = 0; c < 3; c++)
+            {
+                color[c] = min(max(in[c] + values[c], 0), 255);
+            }
+            five_color_level(color[0], color[1], color[2], out);
+            for (int c = 0; c < 3; c++)
+            {
+                errors[c] = color[c] - out[c];
+            }
+        });
+        return result;
+    }
+
+    parallel_rows(image.height, [&](int first_row, int end_row)
+    {
+        for (int row = first_row; row < end_row; row++)
+        {
+            const unsigned char* in = image.row(row);
+            unsigned char* out = result.row(row);
+            for (int col = 0; col < image.width; col++)
+            {
+                int offset = mode == Ordered_Bayer ? bayer_offset(row, col) : 0;
+                five_color_level(in[channels * col] + offset, in[channels * col + 1] + offset,
+                                 in[channels * col + 2] + offset, out + 3 * col);
+            }
+        }
+    });
+    return result;
+}
+
+/**
+ * Description - Asks the user for a dither mode
+ * @return the Dither_Mode
+ */
+int dither_mode_selection()
+{
+    int mode = No_Dither;
+    cout << "Enter dither mode (0 = none, 1 = Floyd-Steinberg, 2 = ordered): ";
+    cin >> mode;
+    if (mode != Floyd_Steinberg && mode != Ordered_Bayer)
+    {
+        mode = No_Dither;
+    }
+    return mode;
+}
+
+/**
+ * IN WORK
+ * Description - Convert image to high contrast (black and white only)
+ * @param filename BMP image filename
+ * @param standard the Luma_Standard used for the gray value
+ * @return the image as a vector of vector of Pixels
+ */
+vector<vector<Pixel>> process_7(const vector<vector<Pixel>>& image, int standard = Luma_Average)
+{ 
+    PROFILE_STAGE("process_7", (long long)image.size() * image[0].size() * sizeof(Pixel) * 2);
+    int num_rows = image.size(); 
+    int num_cols = image[0].size(); 
+
+    vector<vector<Pixel>> new_new_image(num_rows, vector<Pixel> (num_cols));
+
+    for (int row = 0; row < num_rows; row++)
+    {
+        for (int col = 0; col < num_cols; col++)
+        {         
+            int red_color = image[row][col].red;
+            int green_color = image[row][col].green;
+            int blue_color = image[row][col].blue;
+
+            int gray_value = luma(red_color, green_color, blue_color, standard);
+
+            if (gray_value >= 255/2)
+            {
+                new_new_image[row][col].red   = 255;
+                new_new_image[row][col].green = 255;
+                new_new_image[row][col].blue  = 255;
+            }
+            else
+            {
+                new_new_image[row][col].red   = 0;
+                new_new_image[row][col].green = 0;
+                new_new_image[row][col].blue  = 0;
+            }
+        }
+    }
+    return new_new_image;
+}
+
+/**
+ * Description - Process 7 Wrapper function. Takes input filename, calls read_image functions to transform the image into a vector,
+ * calls process_7 function to apply High Contrast, calls write_image fucntion to transform the new vector into a .bmp file, and prints success,
+ * if the image transformation was successful.
+ * @param input_filename BMP image filename
+ */
+void process_7_wrapper(string input_filename)
+{
+    string output_filename = "";
+    vector<vector<Pixel>> image;
+    vector<vector<Pixel>> new_image;
+    double scaling_factor = 1;
+    bool success = true;
+    int x_scale = 1; 
+    int y_scale = 1; 
+
+    cout << "High Contrast selected" << endl << "Enter output BMP filename: ";
+    cin >> output_filename;
+    int dither_mode = dither_mode_selection();
+    int standard = luma_standard_selection();
+    
+    image = load_image(input_filename);
+    if (image.empty())
+    { cout << "Process 7 failed: could not read " << input_filename << endl; return; }
+    if (dither_mode == No_Dither)
+    { new_image = process_7(image, standard); }
+    else
+    { new_image = buffer_to_pixels(quantize_high_contrast(pixels_to_buffer(image), dither_mode, standard)); }
+    success = write_image(output_filename, new_image);
+    
+    if (success == true){cout << "Successfully applied high contrast!" << endl;}
+    else{cout << "Process 7 failed" << endl;}
+}
+
+/**
+ * IN WORK
+ * Description - Lightens image by a scaling factor
+ * @param filename BMP image filename
+ * @return the image as a vector of vector of Pixels
+ */
+vector<vector<Pixel>> process_8(const vector<vector<Pixel>>& image, double scaling_factor)
+{    
+    PROFILE_STAGE("process_8", (long long)image.size() * image[0].size() * sizeof(Pixel) * 2);
+    int num_rows = image.size();
+    int num_cols = image[0].size(); 
+
+    vector<vector<Pixel>> new_new_image(num_rows, vector<Pixel> (num_cols));
+
+    for (int row = 0; row < num_rows; row++)
+    {
+        for (int col = 0; col < num_cols; col++)
+        {          
+            int red_color = image[row][col].red;
+            int green_color = image[row][col].green;
+            int blue_color = image[row][col].blue;
+
+            int color_sum = red_color + green_color + blue_color;
+
+            new_new_image[row][col].red   = (255 - (255 - red_color)   * scaling_factor);
+            new_new_image[row][col].green = (255 - (255 - green_color) * scaling_factor);
+            new_new_image[row][col].blue  = (255 - (255 - blue_color)  * scaling_factor);        
+        }
+    }
+    return new_new_image;
+}
+
+/**
+ * Description - Process 8 Wrapper function. Takes input filename, calls read_image functions to transform the image into a vector,
+ * calls process_8 function to apply Lighten, calls write_image fucntion to transform the new vector into a .bmp file, and prints success,
+ * if the image transformation was successful.
+ * @param input_filename BMP image filename
+ */
+void process_8_wrapper(string input_filename)
+{
+    string output_filename = "";
+    vector<vector<Pixel>> image;
+    vector<vector<Pixel>> new_image;
+    double scaling_factor = 1;
+    bool success = true;
+    int x_scale = 1; 
+    int y_scale = 1; 
+
+    cout << "Lighten selected" << endl << "Enter output BMP filename: ";
+    cin >> output_filename;
+    cout << "Enter scaling factor: ";
+    cin >> scaling_factor;
+    
+    image = load_image(input_filename);
+    if (image.empty())
+    { cout << "Process 8 failed: could not read " << input_filename << endl; return; }
+    new_image = process_8(image, scaling_factor);
+    success = write_image(output_filename, new_image);
+    
+    if (success == true)
+    {cout << "Successfully lightened!" << endl;}
+    else
+    {cout << "Process 8 failed" << endl;}   
+}
+
+/**
+ * IN WORK
+ * Description - Darkens image by a scaling factor
+ * @param filename BMP image filename
+ * @return the image as a vector of vector of Pixels
+ */
+vector<vector<Pixel>> process_9(const vector<vector<Pixel>>& image, double scaling_factor)
+{    
+    PROFILE_STAGE("process_9", (long long)image.size() * image[0].size() * sizeof(Pixel) * 2);
+    int num_rows = image.size(); 
+    int num_cols = image[0].size(); 
+
+    vector<vector<Pixel>> new_new_image(num_rows, vector<Pixel> (num_cols));
+
+    for (int row = 0; row < num_rows; row++)
+    {
+        for (int col = 0; col < num_cols; col++)
+        {          
+            int red_color = image[row][col].red;
+            int green_color = image[row][col].green;
+            int blue_color = image[row][col].blue;
+            int color_sum = red_color + green_color + blue_color;
+
+            new_new_image[row][col].red   = red_color   * scaling_factor;
+            new_new_image[row][col].green = green_color * scaling_factor;
+            new_new_image[row][col].blue  = blue_color  * scaling_factor;    
+        }
+    }
+    return new_new_image;
+}
+
+/**
+ * Description - Process 9 Wrapper function. Takes input filename, calls read_image functions to transform the image into a vector,
+ * calls process_9 function to apply Darken, calls write_image fucntion to transform the new vector into a .bmp file, and prints success,
+ * if the image transformation was successful.
+ * @param input_filename BMP image filename
+ */
+void process_9_wrapper(string input_filename)
+{
+    string output_filename = "";
+    vector<vector<Pixel>> image;
+    vector<vector<Pixel>> new_image;
+    double scaling_factor = 1;
+    bool success = true;
+    int x_scale = 1; 
+    int y_scale = 1; 
+
+    cout << "Darken selected" << endl << "Enter output BMP filename: ";
+    cin >> output_filename;
+    cout << "Enter scaling factor: ";
+    cin >> scaling_factor;
+    
+    image = load_image(input_filename);
+    if (image.empty())
+    { cout << "Process 9 failed: could not read " << input_filename << endl; return; }
+    new_image = process_9(image, scaling_factor);
+    success = write_image(output_filename, new_image);
+    
+    if (success == true)
+    {cout << "Successfully darkened!" << endl;}
+    else
+    {cout << "Process 9 failed" << endl;} 
+}
+
+/**
+ * IN WORK
+ * Description - Converts image to only black, white, red, blue, and green
+ * @param filename BMP image filename
+ * @return the image as a vector of vector of Pixels
+ */
+vector<vector<Pixel>> process_10(const vector<vector<Pixel>>& image)
+{    
+    PROFILE_STAGE("process_10", (long long)image.size() * image[0].size() * sizeof(Pixel) * 2);
+    int num_rows = image.size(); 
+    int num_cols = image[0].size(); 
+
+    vector<vector<Pixel>> new_new_image(num_rows, vector<Pixel> (num_cols));
+
+    for (int row = 0; row < num_rows; row++)
+    {
+        for (int col = 0; col < num_cols; col++)
+        {          
+            int red_color = image[row][col].red;
+            int green_color = image[row][col].green;
+            int blue_color = image[row][col].blue;
+
+            int color_sum = red_color + green_color + blue_color;
+
+            if (color_sum >= 550)
+            {
+                new_new_image[row][col].red   = 255;
+                new_new_image[row][col].green = 255;
+                new_new_image[row][col].blue  = 255;
+            }
+            else if (color_sum <= 150)
+            {
+                new_new_image[row][col].red   = 0;
+                new_new_image[row][col].green = 0;
+                new_new_image[row][col].blue  = 0;
+            }
+            else if (red_color > green_color && red_color > blue_color)
+            {
+                new_new_image[row][col].red   = 255;
+                new_new_image[row][col].green = 0;
+                new_new_image[row][col].blue  = 0;
+            }
+            else if (green_color > red_color && green_color > blue_color)
+            {
+                new_new_image[row][col].red   = 0;
+                new_new_image[row][col].green = 255;
+                new_new_image[row][col].blue  = 0;
+            }
+            else
+            {
+                new_new_image[row][col].red   = 0;
+                new_new_image[row][col].green = 0;
+                new_new_image[row][col].blue  = 255;
+            }           
+        }
+    }
+    return new_new_image;
+}
+
+/**
+ * Description - Process 10 Wrapper function. Takes input filename, calls read_image functions to transform the image into a vector,
+ * calls process_10 function to apply Black, White, Red, Green, Blue, calls write_image fucntion to transform the new vector into a .bmp file, and prints success,
+ * if the image transformation was successful.
+ * @param input_filename BMP image filename
+ */
+void process_10_wrapper(string input_filename)
+{
+    string output_filename = "";
+    vector<vector<Pixel>> image;
+    vector<vector<Pixel>> new_image;
+    double scaling_factor = 1;
+    bool success = true;
+    int x_scale = 1; 
+    int y_scale = 1; 
+
+    cout << "Black, White, Red, Green, Blue selected!" << endl << "Enter output BMP filename: ";
+    cin >> output_filename;
+    int dither_mode = dither_mode_selection();
+    
+    image = load_image(input_filename);
+    if (image.empty())
+    { cout << "Process 10 failed: could not read " << input_filename << endl; return; }
+    if (dither_mode == No_Dither)
+    { new_image = process_10(image); }
+    else
+    { new_image = buffer_to_pixels(quantize_five_colors(pixels_to_buffer(image), dither_mode)); }
+    success = write_image(output_filename, new_image);
+    
+    if (success == true)
+    {cout << "Successfully applied Black, White, Red, Green, Blue filter!" << endl;}
+    else
+    {cout << "Process 10 failed" << endl;}
+}
+
+//
+// THUMBNAIL PYRAMID
+//
+
+/**
+ * Description - Halves the image in both directions with a 2x2 box (area) filter. Odd edges are averaged with
+ * themselves. The vertical pass sums two rows into a 16-bit row and the horizontal pass averages neighbours;
+ * both are plain loops over bytes so the compiler can vectorize them, and rows are split across threads.
+ * @param image the input image
+ * @return the downscaled image
+ */
+Image_Buffer downscale_2x(const Image_Buffer& image)
+{
+    PROFILE_STAGE("downscale 2x", image.data.size() * 5 / 4);
+    int channels = image.channels;
+    Image_Buffer result = make_buffer(max(1, (image.width + 1) / 2), max(1, (image.height + 1) / 2), channels);
+    int in_bytes = image.width * channels;
+
+    parallel_rows(result.height, [&](int first_row, int end_row)
+    {
+        // Row of vertical sums, with one extra pixel so odd widths can reuse the last column
+        vector<unsigned short> sums((image.width + 1) * channels);
+        for (int row = first_row; row < end_row; row++)
+        {
+            const unsigned char* top = image.row(min(2 * row, image.height - 1));
+            const unsigned char* bottom = image.row(min(2 * row + 1, image.height - 1));
+            for (int i = 0; i < in_bytes; i++)
+            {
+                sums[i] = top[i] + bottom[i];
+            }
+            for (int c = 0; c < channels; c++)
+            {
+                sums[in_bytes + c] = sums[in_bytes - channels + c];
+            }
+
+            unsigned char* out = result.row(row);
+            for (int col = 0; col < result.width; col++)
+            {
+                for (int c = 0; c < channels; c++)
+                {
+                    int left = sums[2 * col * channels + c];
+                    int right = sums[(2 * col + 1) * channels + c];
+                    out[col * channels + c] = (left + right + 2) >> 2;
+                }
+            }
+        }
+    });
+    return result;
+}
+
+/**
+ * Description - Builds successive 2x downscales of the image and hands each level to emit as soon as it is made.
+ * Only the previous level is kept in memory, so the levels can be streamed out to disk.
+ * @param image  the full resolution image
+ * @param levels the number of levels to produce (stops early once the image is 1x1)
+ * @param emit   function called as emit(level, image) for level 1, 2, ...
+ */
+void for_each_pyramid_level(const Image_Buffer& image, int levels, const function<void(int, const Image_Buffer&)>& emit)
+{
+    Image_Buffer current;
+    const Image_Buffer* previous = &image;
+    for (int level = 1; level <= levels; level++)
+    {
+        if (previous->width == 1 && previous->height == 1)
+        {
+            break;
+        }
+        current = downscale_2x(*previous);
+        emit(level, current);
+        previous = &current;
+    }
+}
+
+/**
+ * Description - Resizes the image straight from full resolution by averaging the source area under each
+ * output pixel. This is the naive way of making each thumbnail and is used as the benchmark baseline.
+ * @param image      the input image
+ * @param new_width  output width in pixels
+ * @param new_height output height in pixels
+ * @return the resized image
+ */
+Image_Buffer resize_area_naive(const Image_Buffer& image, int new_width, int new_height)
+{
+    int channels = image.channels;
+    Image_Buffer result = make_buffer(new_width, new_height, channels);
+    for (int row = 0; row < new_height; row++)
+    {
+        int first_y = (long long)row * image.height / new_height;
+        int end_y = max(first_y + 1, (int)((long long)(row + 1) * image.height / new_height));
+        for (int col = 0; col < new_width; col++)
+        {
+            int first_x = (long long)col * image.width / new_width;
+            int end_x = max(first_x + 1, (int)((long long)(col + 1) * image.width / new_width));
+            for (int c = 0; c < channels; c++)
+            {
+                long long sum = 0;
+                for (int y = first_y; y < end_y; y++)
+                {
+                    for (int x = first_x; x < end_x; x++)
+                    {
+                        sum += image.row(y)[x * channels + c];
+                    }
+                }
+                long long count = (long long)(end_y - first_y) * (end_x - first_x);
+                result.row(row)[col * channels + c] = (sum + count / 2) / count;
+            }
+        }
+    }
+    return result;
+}
+
+/**
+ * Description - Process 11 Wrapper function. Reads the input image once, builds a thumbnail pyramid of successive
+ * 2x downscales and writes every level to its own BMP file (<prefix>_1.bmp, <prefix>_2.bmp, ...).
+ * @param input_filename BMP image filename
+ */
+void process_11_wrapper(string input_filename)
+{
+    string output_prefix = "";
+    Image_Buffer image;
+    int levels = 1;
+    bool success = true;
+
+    cout << "Thumbnail pyramid selected" << endl << "Enter output filename prefix: ";
+    cin >> output_prefix;
+    cout << "Enter number of levels: ";
+    cin >> levels;
+
+    success = read_image_fast(input_filename, image);
+    if (success)
+    {
+        for_each_pyramid_level(image, levels, [&](int level, const Image_Buffer& thumbnail)
+        {
+            string output_filename = output_prefix + "_" + to_string(level) + ".bmp";
+            success = write_image_fast(output_filename, thumbnail) && success;
+            cout << "  " << output_filename << " (" << thumbnail.width << "x" << thumbnail.height << ")" << endl;
+        });
+    }
+
+    if (success == true)
+    {cout << "Successfully built thumbnail pyramid!" << endl;}
+    else
+    {cout << "Process 11 failed" << endl;}
+}
+
+//
+// SATURATION AND HUE
+//
+
+/**
+ * Description - Scales the color saturation. The image is converted to YCbCr and the chroma is scaled around
+ * neutral, so the luma of every pixel is kept.
+ * @param image  the input image
+ * @param factor the saturation factor (0 = gray, 1 = unchanged, above 1 = more saturated)
+ * @return the new image
+ */
+Image_Buffer process_12(const Image_Buffer& image, double factor)
+{
+    PROFILE_STAGE("process_12", image.data.size() * 2);
+    Image_Buffer result = make_buffer(image.width, image.height, image.channels);
+    // Beyond 255 every chroma step already saturates; clamping also keeps the fixed point scale in range
+    int scale = lround((factor > 0 ? min(factor, 255.0) : 0.0) * 256);
+
+    parallel_rows(image.height, [&](int first_row, int end_row)
+    {
+        vector<unsigned char> ycbcr(image.width * 3);
+        for (int row = first_row; row < end_row; row++)
+        {
+            rgb_to_ycbcr_row(image.row(row), image.channels, ycbcr.data(), image.width);
+            for (int i = 0; i < image.width; i++)
+            {
+                ycbcr[3 * i + 1] = clamp_byte(128 + (((ycbcr[3 * i + 1] - 128) * scale + 128) >> 8));
+                ycbcr[3 * i + 2] = clamp_byte(128 + (((ycbcr[3 * i + 2] - 128) * scale + 128) >> 8));
+            }
+            ycbcr_to_rgb_row(ycbcr.data(), result.row(row), result.channels, image.width);
+        }
+    });
+    keep_alpha(image, result);
+    return result;
+}
+
+/**
+ * Description - Process 12 Wrapper function. Takes input filename, reads it into an image buffer, calls process_12
+ * to change the saturation, writes the result and prints success.
+ * @param input_filename BMP image filename
+ */
+void process_12_wrapper(string input_filename)
+{
+    string output_filename = "";
+    Image_Buffer image;
+    double factor = 1;
+    bool success = true;
+
+    cout << "Saturation selected" << endl << "Enter output BMP filename: ";
+    cin >> output_filename;
+    cout << "Enter saturation factor: ";
+    cin >> factor;
+
+    success = read_image_fast(input_filename, image) && write_image_fast(output_filename, process_12(image, factor));
+
+    if (success == true)
+    {cout << "Successfully changed saturation!" << endl;}
+    else
+    {cout << "Process 12 failed" << endl;}
+}
+
+/**
+ * Description - Rotates the hue of every pixel around the color wheel in HSV space
+ * @param image   the input image
+ * @param degrees the hue rotation in degrees (120 turns red into green)
+ * @return the new image
+ */
+Image_Buffer process_13(const Image_Buffer& image, double degrees)
+{
+    PROFILE_STAGE("process_13", image.data.size() * 2);
+    Image_Buffer result = make_buffer(image.width, image.height, image.channels);
+    int shift = lround(fmod(fmod(degrees, 360) + 360, 360) * HUE_RANGE / 360) % HUE_RANGE;
+
+    parallel_rows(image.height, [&](int first_row, int end_row)
+    {
+        vector<unsigned short> hue(image.width);
+        vector<unsigned char> saturation(image.width);
+        vector<unsigned char> value(image.width);
+        for (int row = first_row; row < end_row; row++)
+        {
+            rgb_to_hsv_row(image.row(row), image.channels, hue.data(), saturation.data(), value.data(), image.width);
+            for (int i = 0; i < image.width; i++)
+            {
+                int h = hue[i] + shift;
+                hue[i] = h >= HUE_RANGE ? h - HUE_RANGE : h;
+            }
+            hsv_to_rgb_row(hue.data(), saturation.data(), value.data(), result.row(row), result.channels, image.width);
+        }
+    });
+    keep_alpha(image, result);
+    return result;
+}
+
+/**
+ * Description - Process 13 Wrapper function. Takes input filename, reads it into an image buffer, calls process_13
+ * to rotate the hue, writes the result and prints success.
+ * @param input_filename BMP image filename
+ */
+void process_13_wrapper(string input_filename)
+{
+    string output_filename = "";
+    Image_Buffer image;
+    double degrees = 0;
+    bool success = true;
+
+    cout << "Hue shift selected" << endl << "Enter output BMP filename: ";
+    cin >> output_filename;
+    cout << "Enter hue shift in degrees: ";
+    cin >> degrees;
+
+    success = read_image_fast(input_filename, image) && write_image_fast(output_filename, process_13(image, degrees));
+
+    if (success == true)
+    {cout << "Successfully shifted hue!" << endl;}
+    else
+    {cout << "Process 13 failed" << endl;}
+}
+
+/**
+ * Description - Checks the color conversions: the fixed point average against (red + green + blue) / 3, and the
+ * largest channel error after a YCbCr and an HSV round trip over every 8-bit color
+ * @return True if every check passed and false otherwise
+ */
+bool check_color_conversions()
+{
+    bool passed = true;
+    for (int sum = 0; sum <= 765; sum++)
+    {
+        int red = min(sum, 255);
+        int green = min(sum - red, 255);
+        int blue = sum - red - green;
+        passed = passed && luma(red, green, blue, Luma_Average) == sum / 3;
+    }
+    cout << "  fixed point average matches (r+g+b)/3: " << (passed ? "yes" : "NO") << endl;
+
+    // One row per red value holding every green, blue combination
+    const int COUNT = 256 * 256;
+    vector<unsigned char> rgb(COUNT * 3);
+    vector<unsigned char> ycbcr(COUNT * 3);
+    vector<unsigned char> back(COUNT * 3);
+    vector<unsigned short> hue(COUNT);
+    vector<unsigned char> saturation(COUNT);
+    vector<unsigned char> value(COUNT);
+    int ycbcr_error = 0;
+    int hsv_error = 0;
+    for (int red = 0; red < 256; red++)
+    {
+        for (int i = 0; i < COUNT; i++)
+        {
+            rgb[3 * i] = red;
+            rgb[3 * i + 1] = i >> 8;
+            rgb[3 * i + 2] = i & 255;
+        }
+        rgb_to_ycbcr_row(rgb.data(), 3, ycbcr.data(), COUNT);
+        ycbcr_to_rgb_row(ycbcr.data(), back.data(), 3, COUNT);
+        for (int i = 0; i < COUNT * 3; i++)
+        {
+            ycbcr_error = max(ycbcr_error, abs(rgb[i] - back[i]));
+        }
+        rgb_to_hsv_row(rgb.data(), 3, hue.data(), saturation.data(), value.data(), COUNT);
+        hsv_to_rgb_row(hue.data(), saturation.data(), value.data(), back.data(), 3, COUNT);
+        for (int i = 0; i < COUNT * 3; i++)
+        {
+            hsv_error = max(hsv_error, abs(rgb[i] - back[i]));
+        }
+    }
+
+    // Rounding the 8-bit intermediate values may cost one level per channel
+    const int YCBCR_TOLERANCE = 1;
+    const int HSV_TOLERANCE = 1;
+    cout << "  YCbCr round trip max error " << ycbcr_error << " (tolerance " << YCBCR_TOLERANCE << ")" << endl;
+    cout << "  HSV round trip max error " << hsv_error << " (tolerance " << HSV_TOLERANCE << ")" << endl;
+    return passed && ycbcr_error <= YCBCR_TOLERANCE && hsv_error <= HSV_TOLERANCE;
+}
+
+//
+// FLIP, TRANSPOSE AND ROTATION
+//
+
+// Ways of mirroring an image offered by process_14
+enum Flip_Mode
+{
+    Flip_Horizontal = 0,    // Mirror left to right
+    Flip_Vertical,          // Mirror top to bottom
+    Flip_Transpose          // Swap rows and columns (mirror across the main diagonal)
+};
+
+// Sampling used by the arbitrary angle rotation
+enum Sampling_Mode
+{
+    Nearest_Sampling = 0,
+    Bilinear_Sampling
+};
+
+/**
+ * Description - Mirrors or transposes an image. The transpose works in 32x32 tiles so both the rows read and the
+ * rows written stay in cache.
+ * @param image the input image
+ * @param mode  the Flip_Mode
+ * @return the new image
+ */
+Image_Buffer process_14(const Image_Buffer& image, int mode)
+{
+    PROFILE_STAGE("process_14", image.data.size() * 2);
+    const int TILE = 32;
+    int channels = image.channels;
+    bool transpose = mode == Flip_Transpose;
+    Image_Buffer result = make_buffer(transpose ? image.height : image.width, transpose ? image.width : image.height, channels);
+    int tile_rows = (result.height + TILE - 1) / TILE;
+
+    parallel_rows(transpose ? tile_rows : result.height, [&](int first_row, int end_row)
+    {
+        for (int row = first_row; row < end_row; row++)
+        {
+            if (mode == Flip_Vertical)
+            {
+                copy_n(image.row(image.height - 1 - row), (size_t)image.width * channels, result.row(row));
+            }
+            else if (mode == Flip_Horizontal)
+            {
+                const unsigned char* in = image.row(row);
+                unsigned char* out = result.row(row);
+                for (int col = 0; col < image.width; col++)
+                {
+                    copy_n(in + (image.width - 1 - col) * channels, channels, out + col * channels);
+                }
+            }
+            else
+            {
+                // row is a band of TILE output rows (input columns)
+                int first_out_row = row * TILE;
+                int end_out_row = min(result.height, first_out_row + TILE);
+                for (int first_out_col = 0; first_out_col < result.width; first_out_col += TILE)
+                {
+                    int end_out_col = min(result.width, first_out_col + TILE);
+                    for (int out_row = first_out_row; out_row < end_out_row; out_row++)
+                    {
+                        unsigned char* out = result.row(out_row);
+                        for (int out_col = first_out_col; out_col < end_out_col; out_col++)
+                        {
+                            copy_n(image.row(out_col) + out_row * channels, channels, out + out_col * channels);
+                        }
+                    }
+                }
+            }
+        }
+    });
+    return result;
+}
+
+/**
+ * Description - Process 14 Wrapper function. Takes input filename, reads it into an image buffer, calls process_14
+ * to flip or transpose it, writes the result and prints success.
+ * @param input_filename BMP image filename
+ */
+void process_14_wrapper(string input_filename)
+{
+    string output_filename = "";
+    Image_Buffer image;
+    int mode = Flip_Horizontal;
+    bool success = true;
+
+    cout << "Flip selected" << endl << "Enter output BMP filename: ";
+    cin >> output_filename;
+    cout << "Enter flip (0 = horizontal, 1 = vertical, 2 = transpose): ";
+    cin >> mode;
+    if (mode < Flip_Horizontal || mode > Flip_Transpose)
+    { cout << "Process 14 failed: unknown flip " << mode << endl; return; }
+
+    success = read_image_fast(input_filename, image) && write_image_fast(output_filename, process_14(image, mode));
+
+    if (success == true)
+    {cout << "Successfully flipped!" << endl;}
+    else
+    {cout << "Process 14 failed" << endl;}
+}
+
+/**
+ * Description - Rotates an image clockwise by any angle. The canvas grows to fit the whole rotated image and
+ * the uncovered corners are white (the usual background of scanned documents), or transparent for 32-bit images. For every output row the source
+ * position of the first pixel is computed once, then stepped along the row in 16.16 fixed point, so there is no
+ * trigonometry per pixel. Rows are split across threads.
+ * @param image    the input image
+ * @param degrees  the clockwise rotation in degrees (callers reject non-finite angles; they are treated as 0)
+ * @param sampling the Sampling_Mode
+ * @return the rotated image
+ */
+Image_Buffer process_15(const Image_Buffer& image, double degrees, int sampling)
+{
+    PROFILE_STAGE("process_15", image.data.size());
+    const long long ONE = 1 << 16;
+    const double PI = 3.14159265358979323846;
+    int channels = image.channels;
+    unsigned char background[4] = {255, 255, 255, 0};
+
+    // A non-finite angle has no rotation; it would turn every size and position below into garbage
+    degrees = isfinite(degrees) ? fmod(degrees, 360) : 0;
+    double radians = degrees * PI / 180;
+    double cosine = cos(radians);
+    double sine = sin(radians);
+
+    // Snap values like cos(90 degrees) = 6e-17 so right angles give exact sizes and positions
+    cosine = fabs(cosine - lround(cosine)) < 1e-12 ? lround(cosine) : cosine;
+    sine = fabs(sine - lround(sine)) < 1e-12 ? lround(sine) : sine;
+    int new_width = max(1L, lround(ceil(fabs(image.width * cosine) + fabs(image.height * sine) - 1e-9)));
+    int new_height = max(1L, lround(ceil(fabs(image.width * sine) + fabs(image.height * cosine) - 1e-9)));
+    Image_Buffer result = make_buffer(new_width, new_height, channels);
+    PROFILE_BYTES(result.data.size());
+
+    // Source position per output step, in 16.16 fixed point
+    long long step_x = llround(cosine * ONE);
+    long long step_y = llround(-sine * ONE);
+
+    parallel_rows(new_height, [&](int first_row, int end_row)
+    {
+        for (int row = first_row; row < end_row; row++)
+        {
+            // Source position (in pixel index units) of the center of the first pixel in this row
+            double dx = 0.5 - new_width / 2.0;
+            double dy = row + 0.5 - new_height / 2.0;
+            long long source_x = llround((cosine * dx + sine * dy + image.width / 2.0 - 0.5) * ONE);
+            long long source_y = llround((-sine * dx + cosine * dy + image.height / 2.0 - 0.5) * ONE);
+            unsigned char* out = result.row(row);
+
+            for (int col = 0; col < new_width; col++, source_x += step_x, source_y += step_y, out += channels)
+            {
+                if (sampling == Nearest_Sampling)
+                {
+                    long long x = (source_x + ONE / 2) >> 16;
+                    long long y = (source_y + ONE / 2) >> 16;
+                    if (x >= 0 && x < image.width && y >= 0 && y < image.height)
+                    {
+                        copy_n(image.row(y) + x * channels, channels, out);
+                    }
+                    else
+                    {
+                        copy_n(background, channels, out);
+                    }
+                    continue;
+                }
+
+                long long x = source_x >> 16;
+                long long y = source_y >> 16;
+                int fraction_x = (source_x >> 8) & 255;
+                int fraction_y = (source_y >> 8) & 255;
+                if (x < -1 || x >= image.width || y < -1 || y >= image.height)
+                {
+                    copy_n(background, channels, out);
+                    continue;
+                }
+
+                // Neighbours outside the image count as background so the edges blend into it
+                const unsigned char* corners[4];
+                for (int k = 0; k < 4; k++)
+                {
+                    long long corner_x = x + (k & 1);
+                    long long corner_y = y + (k >> 1);
+                    bool inside = corner_x >= 0 && corner_x < image.width && corner_y >= 0 && corner_y < image.height;
+                    corners[k] = inside ? image.row(corner_y) + corner_x * channels : background;
+                }
+                for (int c = 0; c < channels; c++)
+                {
+                    int top = corners[0][c] * (256 - fraction_x) + corners[1][c] * fraction_x;
+                    int bottom = corners[2][c] * (256 - fraction_x) + corners[3][c] * fraction_x;
+                    out[c] = (top * (256 - fraction_y) + bottom * fraction_y + 32768) >> 16;
+                }
+            }
+        }
+    });
+    return result;
+}
+
+/**
+ * Description - Process 15 Wrapper function. Takes input filename, reads it into an image buffer, calls process_15
+ * to rotate it by any angle, writes the result and prints success.
+ * @param input_filename BMP image filename
+ */
+void process_15_wrapper(string input_filename)
+{
+    string output_filename = "";
+    Image_Buffer image;
+    double degrees = 0;
+    int sampling = Bilinear_Sampling;
+    bool success = true;
+
+    cout << "Rotate by any angle selected" << endl << "Enter output BMP filename: ";
+    cin >> output_filename;
+    cout << "Enter clockwise angle in degrees: ";
+    cin >> degrees;
+    if (!isfinite(degrees))
+    { cout << "Process 15 failed: the angle must be a number" << endl; return; }
+    cout << "Enter sampling (0 = nearest, 1 = bilinear): ";
+    cin >> sampling;
+
+    success = read_image_fast(input_filename, image) && write_image_fast(output_filename, process_15(image, degrees, sampling));
+
+    if (success == true)
+    {cout << "Successfully rotated!" << endl;}
+    else
+    {cout << "Process 15 failed" << endl;}
+}
+
+/**
+ * Description - Rotation with the trigonometry and bilinear weights recomputed in floating point for every pixel.
+ * Same geometry as process_15, used as the benchmark baseline.
+ * @param image   the input image
+ * @param degrees the clockwise rotation in degrees
+ * @return the rotated image
+ */
+Image_Buffer rotate_image_naive(const Image_Buffer& image, double degrees)
+{
+    const double PI = 3.14159265358979323846;
+    int channels = image.channels;
+    double radians = degrees * PI / 180;
+    int new_width = max(1L, lround(ceil(fabs(image.width * cos(radians)) + fabs(image.height * sin(radians)) - 1e-9)));
+    int new_height = max(1L, lround(ceil(fabs(image.width * sin(radians)) + fabs(image.height * cos(radians)) - 1e-9)));
+    Image_Buffer result = make_buffer(new_width, new_height, channels);
+
+    for (int row = 0; row < new_height; row++)
+    {
+        for (int col = 0; col < new_width; col++)
+        {
+            double dx = col + 0.5 - new_width / 2.0;
+            double dy = row + 0.5 - new_height / 2.0;
+            double x = cos(radians) * dx + sin(radians) * dy + image.width / 2.0 - 0.5;
+            double y = -sin(radians) * dx + cos(radians) * dy + image.height / 2.0 - 0.5;
+            for (int c = 0; c < channels; c++)
+            {
+                double value = 0;
+                for (int k = 0; k < 4; k++)
+                {
+                    int corner_x = floor(x) + (k & 1);
+                    int corner_y = floor(y) + (k >> 1);
+                    double weight = (1 - fabs(x - corner_x)) * (1 - fabs(y - corner_y));
+                    bool inside = corner_x >= 0 && corner_x < image.width && corner_y >= 0 && corner_y < image.height;
+                    value += weight * (inside ? image.row(corner_y)[corner_x * channels + c] : 255);
+                }
+                result.row(row)[col * channels + c] = min(255.0, max(0.0, value + 0.5));
+            }
+        }
+    }
+    return result;
+}
+
+/**
+ * Description - Benchmarks the fixed point rotation (nearest and bilinear) against per-pixel floating point math
+ * @param image the test image
+ */
+void benchmark_rotate(const Image_Buffer& image)
+{
+    double megapixels = (double)image.width * image.height / 1e6;
+    cout << "Rotate benchmark on " << image.width << "x" << image.height << ", 7 degrees, " << worker_count() << " threads" << endl;
+    double nearest_ms = time_ms([&]() { process_15(image, 7, Nearest_Sampling); }, 3);
+    double bilinear_ms = time_ms([&]() { process_15(image, 7, Bilinear_Sampling); }, 3);
+    double naive_ms = time_ms([&]() { rotate_image_naive(image, 7); }, 1);
+    cout << "  fixed point nearest " << megapixels / nearest_ms * 1000 << " Mpixels/s" << endl;
+    cout << "  fixed point bilinear " << megapixels / bilinear_ms * 1000 << " Mpixels/s" << endl;
+    cout << "  per-pixel trig bilinear " << megapixels / naive_ms * 1000 << " Mpixels/s" << endl;
+    double flip_ms = time_ms([&]() { process_14(image, Flip_Horizontal); }, 3);
+    double transpose_ms = time_ms([&]() { process_14(image, Flip_Transpose); }, 3);
+    cout << "  flip " << megapixels / flip_ms * 1000 << " Mpixels/s, transpose " << megapixels / transpose_ms * 1000 << " Mpixels/s" << endl;
+}
+
+/**
+ * Description - Benchmarks every buffer placement policy on a large image: allocating and filling it from the
+ * workers, a streaming pass (vertical flip) and a TLB heavy pass (transpose). Workers are pinned to CPUs.
+ * @param width  image width
+ * @param height image height
+ */
+void benchmark_placement(int width, int height)
+{
+    pin_workers = true;
+    double gigabytes = (double)width * height * 3 / 1e9;
+    cout << "Placement benchmark on " << width << "x" << height << " (" << gigabytes << " GB per image), "
+         << worker_count() << " threads, NUMA node mask 0x" << hex << numa_node_mask() << dec << endl;
+
+    for (int policy = 0; policy < PLACEMENT_COUNT; policy++)
+    {
+        buffer_placement = (Placement_Policy)policy;
+        Image_Buffer image;
+        double fill_ms = time_ms([&]()
+        {
+            image = Image_Buffer();
+            image = make_buffer(width, height);
+            parallel_rows(height, [&](int first_row, int end_row)
+            {
+                for (int row = first_row; row < end_row; row++)
+                {
+                    unsigned char* out = image.row(row);
+                    for (int i = 0; i < width * 3; i++)
+                    {
+                        out[i] = (row + i) & 255;
+                    }
+                }
+            });
+        }, 2);
+        double flip_ms = time_ms([&]() { process_14(image, Flip_Vertical); }, 3);
+        double transpose_ms = time_ms([&]() { process_14(image, Flip_Transpose); }, 3);
+        cout << "  " << setw(12) << left << PLACEMENT_NAMES[policy] << right
+             << " allocate+fill " << fixed << setprecision(1) << setw(8) << fill_ms << " ms"
+             << "  flip " << setw(6) << 2 * gigabytes / flip_ms * 1000 << " GB/s"
+             << "  transpose " << setw(6) << 2 * gigabytes / transpose_ms * 1000 << " GB/s" << defaultfloat << endl;
+    }
+    buffer_placement = Placement_Default;
+}
+
+/**
+ * Description - Benchmarks the thumbnail pyramid against naive area resampling from full resolution at every size
+ * @param image  the full resolution image
+ * @param levels the number of levels
+ */
+void benchmark_pyramid(const Image_Buffer& image, int levels)
+{
+    vector<pair<int, int>> sizes;
+    for_each_pyramid_level(image, levels, [&](int, const Image_Buffer& thumbnail)
+    {
+        sizes.push_back({thumbnail.width, thumbnail.height});
+    });
+
+    cout << "Pyramid benchmark on " << image.width << "x" << image.height << ", " << worker_count() << " threads" << endl;
+    double pyramid_ms = time_ms([&]()
+    {
+        for_each_pyramid_level(image, levels, [](int, const Image_Buffer&) {});
+    }, 5);
+
+    double naive_total_ms = 0;
+    for (size_t i = 0; i < sizes.size(); i++)
+    {
+        double naive_ms = time_ms([&]() { resize_area_naive(image, sizes[i].first, sizes[i].second); }, 3);
+        naive_total_ms += naive_ms;
+        cout << "  level " << i + 1 << " (" << sizes[i].first << "x" << sizes[i].second << "): naive " << naive_ms << " ms" << endl;
+    }
+    cout << "  all levels: pyramid " << pyramid_ms << " ms, naive " << naive_total_ms << " ms, speedup "
+         << naive_total_ms / pyramid_ms << "x" << endl;
+}
+
+/**
+ * Description - Reports the throughput of both quantizers in every dither mode
+ * @param image the test image
+ */
+void benchmark_dither(const Image_Buffer& image)
+{
+    const string MODE_NAMES[] = {"threshold", "Floyd-Steinberg", "ordered"};
+    double megapixels = (double)image.width * image.height / 1e6;
+
+    cout << "Dither benchmark on " << image.width << "x" << image.height << ", " << worker_count() << " threads" << endl;
+    for (int mode = No_Dither; mode <= Ordered_Bayer; mode++)
+    {
+        double high_contrast_ms = time_ms([&]() { quantize_high_contrast(image, mode); }, 3);
+        double five_color_ms = time_ms([&]() { quantize_five_colors(image, mode); }, 3);
+        cout << "  " << MODE_NAMES[mode] << ": high contrast " << megapixels / high_contrast_ms * 1000 << " Mpixels/s, "
+             << "5-color " << megapixels / five_color_ms * 1000 << " Mpixels/s" << endl;
+    }
+}
+
+//
+// DENOISING
+//
+
+/**
+ * Description - Median filter over a (2 * radius + 1) square window, per channel, with the constant time
+ * sliding histogram algorithm (Perreault and Hebert): every column keeps a histogram of the window rows, and the
+ * window histogram slides along the row by adding the entering column and removing the leaving one. The cost per
+ * pixel does not depend on the radius. Only a 16 bin coarse histogram slides every column; it picks the bucket
+ * holding the median, and only that bucket of the 256 bin histogram is brought up to date.
+ * Edge pixels are repeated outside the image. Row blocks are split across threads. Alpha passes through.
+ * @param image  the input image
+ * @param radius the window radius, 0-127
+ * @return the filtered image
+ */
+Image_Buffer process_18(const Image_Buffer& image, int radius)
+{
+    PROFILE_STAGE("process_18", image.data.size() * 2);
+    radius = min(max(radius, 0), 127);
+    int width = image.width;
+    int height = image.height;
+    int channels = image.channels;
+    int samples = width * 3;    // only the color channels have histograms; alpha is kept
+    int window = 2 * radius + 1;
+    int rank = window * window / 2 + 1;
+    Image_Buffer result = make_buffer(width, height, channels);
+    auto clamp_index = [](int index, int count) { return min(max(index, 0), count - 1); };
+
+    parallel_rows(height, [&](int first_row, int end_row)
+    {
+        // Fine (256 bin) and coarse (16 bin) histograms of every column and color channel over the window rows
+        vector<unsigned short> fine((size_t)samples * 256, 0);
+        vector<unsigned short> coarse((size_t)samples * 16, 0);
+        auto add_row = [&](int row, int change)
+        {
+            const unsigned char* in = image.row(clamp_index(row, height));
+            for (int col = 0; col < width; col++)
+            {
+                for (int c = 0; c < 3; c++)
+                {
+                    size_t i = (size_t)col * 3 + c;
+                    int value = in[col * channels + c];
+                    fine[i * 256 + value] += change;
+                    coarse[i * 16 + (value >> 4)] += change;
+                }
+            }
+        };
+        for (int dy = -radius; dy <= radius; dy++)
+        {
+            add_row(first_row + dy, 1);
+        }
+
+        for (int row = first_row; row < end_row; row++)
+        {
+            if (row > first_row)
+            {
+                add_row(row - radius - 1, -1);
+                add_row(row + radius, 1);
+            }
+            unsigned char* out = result.row(row);
+            for (int c = 0; c < 3; c++)
+            {
+                unsigned short window_fine[256] = {};
+                unsigned short window_coarse[16] = {};
+                int fine_column[16];    // column each bucket of window_fine is up to date for
+                auto column_index = [&](int col) { return (size_t)clamp_index(col, width) * 3 + c; };
+                for (int dx = -radius; dx <= radius; dx++)
+                {
+                    size_t i = column_index(dx);
+                    for (int v = 0; v < 256; v++)
+                    {
+                        window_fine[v] += fine[i * 256 + v];
+                    }
+                    for (int v = 0; v < 16; v++)
+                    {
+                        window_coarse[v] += coarse[i * 16 + v];
+                    }
+                }
+                fill_n(fine_column, 16, 0);
+
+                for (int col = 0; col < width; col++)
+                {
+                    // The coarse histogram slides every column; 16-bit wrap around cancels out because the
+                    // window counts never go negative
+                    if (col > 0)
+                    {
+                        const unsigned short* entering = &coarse[column_index(col + radius) * 16];
+                        const unsigned short* leaving = &coarse[column_index(col - radius - 1) * 16];
+                        for (int v = 0; v < 16; v++)
+                        {
+                            window_coarse[v] += (unsigned short)(entering[v] - leaving[v]);
+                        }
+                    }
+                    int count = 0;
+                    int bucket = 0;
+                    while (count + window_coarse[bucket] < rank)
+                    {
+                        count += window_coarse[bucket++];
+                    }
+
+                    // Only the bucket holding the median is brought up to date: stepped column by column when
+                    // it is a little behind, rebuilt from the window columns when it is far behind
+                    unsigned short* counts = &window_fine[bucket * 16];
+                    if (col - fine_column[bucket] > window)
+                    {
+                        fill_n(counts, 16, 0);
+                        for (int dx = -radius; dx <= radius; dx++)
+                        {
+                            const unsigned short* column = &fine[column_index(col + dx) * 256 + bucket * 16];
+                            for (int v = 0; v < 16; v++)
+                            {
+                                counts[v] += column[v];
+                            }
+                        }
+                    }
+                    else
+                    {
+                        for (int step = fine_column[bucket] + 1; step <= col; step++)
+                        {
+                            const unsigned short* entering = &fine[column_index(step + radius) * 256 + bucket * 16];
+                            const unsigned short* leaving = &fine[column_index(step - radius - 1) * 256 + bucket * 16];
+                            for (int v = 0; v < 16; v++)
+                            {
+                                counts[v] += (unsigned short)(entering[v] - leaving[v]);
+                            }
+                        }
+                    }
+                    fine_column[bucket] = col;
+
+                    int value = 0;
+                    while (count + counts[value] < rank)
+                    {
+                        count += counts[value++];
+                    }
+                    out[col * channels + c] = bucket * 16 + value;
+                }
+            }
+        }
+    });
+    keep_alpha(image, result);
+    return result;
+}
+
+/**
+ * Description - Edge preserving smoothing with the separable bilateral approximation: a horizontal then a
+ * vertical 1D bilateral pass, so the cost grows with the radius instead of its square. Neighbours are weighted
+ * by a Gaussian of their distance (sigma = radius / 2) and a Gaussian of their color difference, measured as the
+ * mean absolute difference over red, green and blue. Both weights come from lookup tables and rows are split
+ * across threads. Alpha passes through, and in images with alpha each neighbour is also weighted by its alpha, so
+ * the color of transparent pixels does not bleed into visible ones.
+ * @param image       the input image
+ * @param radius      the window radius, 1-64
+ * @param range_sigma color difference (in levels) at which the weight falls to about 60%
+ * @return the filtered image
+ */
+Image_Buffer process_19(const Image_Buffer& image, int radius, double range_sigma)
+{
+    PROFILE_STAGE("process_19", image.data.size() * 4);
+    radius = min(max(radius, 1), 64);
+    range_sigma = max(range_sigma, 1.0);
+    double spatial_sigma = radius / 2.0;
+    vector<float> spatial_weight(2 * radius + 1);
+    for (int k = -radius; k <= radius; k++)
+    {
+        spatial_weight[k + radius] = exp(-k * k / (2 * spatial_sigma * spatial_sigma));
+    }
+    // Indexed by the summed absolute difference of the three color channels
+    vector<float> range_weight(3 * 255 + 1);
+    for (size_t d = 0; d < range_weight.size(); d++)
+    {
+        double difference = d / 3.0;
+        range_weight[d] = exp(-difference * difference / (2 * range_sigma * range_sigma));
+    }
+    float alpha_weight[256];
+    for (int a = 0; a < 256; a++)
+    {
+        alpha_weight[a] = a / 255.0f;
+    }
+
+    // One 1D pass along x (vertical = false) or y
+    auto bilateral_pass = [&](const Image_Buffer& in, bool vertical)
+    {
+        int channels = in.channels;
+        Image_Buffer out = make_buffer(in.width, in.height, channels);
+        parallel_rows(in.height, [&](int first_row, int end_row)
+        {
+            vector<float> sums(in.width * channels);
+            vector<float> weights(in.width);
+            for (int row = first_row; row < end_row; row++)
+            {
+                const unsigned char* center = in.row(row);
+                fill(sums.begin(), sums.end(), 0.0f);
+                fill(weights.begin(), weights.end(), 0.0f);
+                for (int k = -radius; k <= radius; k++)
+                {
+                    const unsigned char* neighbour_row = vertical ? in.row(min(max(row + k, 0), in.height - 1)) : center;
+                    for (int col = 0; col < in.width; col++)
+                    {
+                        const unsigned char* p = center + col * channels;
+                        const unsigned char* q = vertical ? neighbour_row + col * channels
+                                                          : center + min(max(col + k, 0), in.width - 1) * channels;
+                        int difference = abs(p[0] - q[0]) + abs(p[1] - q[1]) + abs(p[2] - q[2]);
+                        float weight = spatial_weight[k + radius] * range_weight[difference] * (channels == 4 ? alpha_weight[q[3]] : 1.0f);
+                        weights[col] += weight;
+                        for (int c = 0; c < 3; c++)
+                        {
+                            sums[col * channels + c] += weight * q[c];
+                        }
+                    }
+                }
+                unsigned char* result = out.row(row);
+                for (int col = 0; col < in.width; col++)
+                {
+                    // A pixel with only transparent neighbours (and itself transparent) keeps its color
+                    for (int c = 0; c < 3; c++)
+                    {
+                        result[col * channels + c] = weights[col] > 0 ? (unsigned char)(sums[col * channels + c] / weights[col] + 0.5f)
+                                                                      : center[col * channels + c];
+                    }
+                    if (channels == 4)
+                    {
+                        result[col * channels + 3] = center[col * channels + 3];
+                    }
+                }
+            }
+        });
+        return out;
+    };
+    return bilateral_pass(bilateral_pass(image, false), true);
+}
+
+/**
+ * Description - Median filter wrapper function. Takes input filename, reads it into an image buffer, calls
+ * process_18 with the radius entered, writes the result and prints success.
+ * @param input_filename BMP image filename
+ */
+void process_18_wrapper(string input_filename)
+{
+    string output_filename = "";
+    Image_Buffer image;
+    int radius = 1;
+    bool success = true;
+
+    cout << "Median denoise selected" << endl << "Enter output BMP filename: ";
+    cin >> output_filename;
+    cout << "Enter radius (1-127): ";
+    cin >> radius;
+    if (radius < 1 || radius > 127)
+    { cout << "Process 18 failed: the radius must be 1-127" << endl; return; }
+
+    success = read_image_fast(input_filename, image) && write_image_fast(output_filename, process_18(image, radius));
+
+    if (success == true)
+    {cout << "Successfully removed noise!" << endl;}
+    else
+    {cout << "Process 18 failed" << endl;}
+}
+
+/**
+ * Description - Bilateral filter wrapper function. Takes input filename, reads it into an image buffer, calls
+ * process_19 with the radius and color sigma entered, writes the result and prints success.
+ * @param input_filename BMP image filename
+ */
+void process_19_wrapper(string input_filename)
+{
+    string output_filename = "";
+    Image_Buffer image;
+    int radius = 3;
+    double range_sigma = 30;
+    bool success = true;
+
+    cout << "Bilateral denoise selected" << endl << "Enter output BMP filename: ";
+    cin >> output_filename;
+    cout << "Enter radius (1-64): ";
+    cin >> radius;
+    if (radius < 1 || radius > 64)
+    { cout << "Process 19 failed: the radius must be 1-64" << endl; return; }
+    cout << "Enter color sigma in levels (for example 30): ";
+    cin >> range_sigma;
+
+    success = read_image_fast(input_filename, image) && write_image_fast(output_filename, process_19(image, radius, range_sigma));
+
+    if (success == true)
+    {cout << "Successfully smoothed!" << endl;}
+    else
+    {cout << "Process 19 failed" << endl;}
+}
+
+/**
+ * Description - Median filter that sorts every window, the benchmark baseline for process_18 (same output,
+ * alpha passes through)
+ * @param image  the input image
+ * @param radius the window radius
+ * @return the filtered image
+ */
+Image_Buffer median_naive(const Image_Buffer& image, int radius)
+{
+    int channels = image.channels;
+    Image_Buffer result = make_buffer(image.width, image.height, channels);
+    vector<unsigned char> values;
+    for (int row = 0; row < image.height; row++)
+    {
+        for (int col = 0; col < image.width; col++)
+        {
+            for (int c = 0; c < 3; c++)
+            {
+                values.clear();
+                for (int dy = -radius; dy <= radius; dy++)
+                {
+                    const unsigned char* in = image.row(min(max(row + dy, 0), image.height - 1));
+                    for (int dx = -radius; dx <= radius; dx++)
+                    {
+                        values.push_back(in[min(max(col + dx, 0), image.width - 1) * channels + c]);
+                    }
+                }
+                nth_element(values.begin(), values.begin() + values.size() / 2, values.end());
+                result.row(row)[col * channels + c] = values[values.size() / 2];
+            }
+        }
+    }
+    keep_alpha(image, result);
+    return result;
+}
+
+/**
+ * Description - Full 2D bilateral filter with the weights of process_19 (including alpha), the benchmark baseline
+ * @param image       the input image
+ * @param radius      the window radius
+ * @param range_sigma color sigma in levels
+ * @return the filtered image
+ */
+Image_Buffer bilateral_naive(const Image_Buffer& image, int radius, double range_sigma)
+{
+    int channels = image.channels;
+    double spatial_sigma = radius / 2.0;
+    Image_Buffer result = make_buffer(image.width, image.height, channels);
+    for (int row = 0; row < image.height; row++)
+    {
+        for (int col = 0; col < image.width; col++)
+        {
+            const unsigned char* p = image.row(row) + col * channels;
+            double sums[4] = {};
+            double total = 0;
+            for (int dy = -radius; dy <= radius; dy++)
+            {
+                for (int dx = -radius; dx <= radius; dx++)
+                {
+                    const unsigned char* q = image.row(min(max(row + dy, 0), image.height - 1))
+                                           + min(max(col + dx, 0), image.width - 1) * channels;
+                    double difference = (abs(p[0] - q[0]) + abs(p[1] - q[1]) + abs(p[2] - q[2])) / 3.0;
+                    double weight = exp(-(dx * dx + dy * dy) / (2 * spatial_sigma * spatial_sigma))
+                                  * exp(-difference * difference / (2 * range_sigma * range_sigma))
+                                  * (channels == 4 ? q[3] / 255.0 : 1);
+                    total += weight;
+                    for (int c = 0; c < 3; c++)
+                    {
+                        sums[c] += weight * q[c];
+                    }
+                }
+            }
+            for (int c = 0; c < 3; c++)
+            {
+                result.row(row)[col * channels + c] = total > 0 ? (unsigned char)(sums[c] / total + 0.5) : p[c];
+            }
+        }
+    }
+    keep_alpha(image, result);
+    return result;
+}
+
+/**
+ * Description - Checks the median and bilateral filters on an image with alpha: alpha passes through unchanged,
+ * the median matches median_naive, and the color of fully transparent pixels does not reach visible ones
+ * @return True if every check passed and false otherwise
+ */
+bool check_denoise_alpha()
+{
+    Image_Buffer rgb = make_test_image(45, 31);
+    Image_Buffer image = make_buffer(rgb.width, rgb.height, 4);
+    for (size_t i = 0, count = (size_t)rgb.width * rgb.height; i < count; i++)
+    {
+        copy_n(&rgb.data[3 * i], 3, &image.data[4 * i]);
+        image.data[4 * i + 3] = i % 3 == 0 ? 0 : i * 11 % 256;
+    }
+    // The same image with other colors under the transparent pixels
+    Image_Buffer repainted = image;
+    for (size_t i = 0; i < repainted.data.size(); i += 4)
+    {
+        if (repainted.data[i + 3] == 0)
+        {
+            fill_n(&repainted.data[i], 3, 255 - repainted.data[i]);
+        }
+    }
+
+    bool passed = true;
+    for (int filter = 18; filter <= 19; filter++)
+    {
+        Image_Buffer result = filter == 18 ? process_18(image, 2) : process_19(image, 2, 30);
+        for (size_t i = 3; i < image.data.size(); i += 4)
+        {
+            passed = passed && result.channels == 4 && result.data[i] == image.data[i];
+        }
+    }
+    passed = process_18(image, 2).data == median_naive(image, 2).data && passed;
+
+    Image_Buffer smoothed = process_19(image, 3, 30);
+    Image_Buffer smoothed_repainted = process_19(repainted, 3, 30);
+    for (size_t i = 0; i < image.data.size(); i += 4)
+    {
+        passed = passed && (image.data[i + 3] == 0 || equal(&smoothed.data[i], &smoothed.data[i + 3], &smoothed_repainted.data[i]));
+    }
+    cout << "  median and bilateral keep alpha and ignore transparent pixels: " << (passed ? "yes" : "NO") << endl;
+    return passed;
+}
+
+/**
+ * Description - Benchmarks the median and bilateral filters against the naive versions across radii and image
+ * sizes. The naive versions only run where they finish in reasonable time.
+ */
+void benchmark_denoise()
+{
+    const int SIZES[][2] = {{512, 384}, {2048, 1536}};
+    const int RADII[] = {1, 3, 7, 15, 31};
+    cout << "Denoise benchmark, " << worker_count() << " threads (Mpixels/s)" << endl;
+    for (const auto& size : SIZES)
+    {
+        Image_Buffer image = make_test_image(size[0], size[1]);
+        double megapixels = (double)size[0] * size[1] / 1e6;
+        for (int radius : RADII)
+        {
+            bool run_naive = (double)size[0] * size[1] * (2 * radius + 1) * (2 * radius + 1) < 5e7;
+            double median_ms = time_ms([&]() { process_18(image, radius); }, 1);
+            double bilateral_ms = time_ms([&]() { process_19(image, radius, 30); }, 1);
+            cout << "  " << size[0] << "x" << size[1] << " radius " << setw(2) << radius
+                 << ": median " << megapixels / median_ms * 1000 << ", bilateral " << megapixels / bilateral_ms * 1000;
+            if (run_naive)
+            {
+                double naive_median_ms = time_ms([&]() { median_naive(image, radius); }, 1);
+                double naive_bilateral_ms = time_ms([&]() { bilateral_naive(image, radius, 30); }, 1);
+                cout << "; naive median " << megapixels / naive_median_ms * 1000
+                     << ", naive bilateral " << megapixels / naive_bilateral_ms * 1000;
+            }
+            cout << endl;
+        }
+    }
+}
+
+//
+// BLENDING AND COMPOSITING
+//
+
+// How overlay colors combine with the image below them
+enum Blend_Mode
+{
+    Blend_Over = 0,     // Porter-Duff source over: the overlay simply covers the image
+    Blend_Multiply,     // Darkens: image * overlay
+    Blend_Screen,       // Lightens: inverse of multiplying the inverses
+    Blend_Overlay       // Multiply in the image's darks, screen in its lights
+};
+
+const char* BLEND_NAMES[] = {"over", "multiply", "screen", "overlay"};
+
+/**
+ * Description - Divides by 255 with rounding, exact for 0 to 255 * 255
+ * @param value the value
+ * @return value / 255 rounded to nearest
+ */
+inline int div255(int value)
+{
+    value += 128;
+    return (value + (value >> 8)) >> 8;
+}
+
+/**
+ * Description - Blends one channel of the overlay onto the image below it
+ * @param backdrop the image value
+ * @param source   the overlay value
+ * @return the blended value
+ */
+template <int MODE>
+inline int blend_channel(int backdrop, int source)
+{
+    switch (MODE)
+    {
+    case Blend_Multiply: return div255(backdrop * source);
+    case Blend_Screen: return backdrop + source - div255(backdrop * source);
+    case Blend_Overlay: return backdrop < 128 ? div255(2 * backdrop * source) : 255 - div255(2 * (255 - backdrop) * (255 - source));
+    default: return source;
+    }
+}
+
+/**
+ * Description - Composites a row of overlay pixels onto a row of image pixels in place, following the W3C
+ * compositing model with non-premultiplied colors. The blend mode is a template parameter and opaque images
+ * (3 channels) get their own branch free loop so the compiler can vectorize both.
+ * @param backdrop          the image row
+ * @param backdrop_channels 3 or 4
+ * @param source            the overlay row
+ * @param source_channels   3 (opaque) or 4
+ * @param count             number of pixels
+ * @param opacity           overall opacity of the overlay, 0-255
+ */
+template <int MODE>
+void composite_row(unsigned char* backdrop, int backdrop_channels, const unsigned char* source, int source_channels, int count, int opacity)
+{
+    if (backdrop_channels == 3)
+    {
+        for (int i = 0; i < count; i++)
+        {
+            unsigned char* b = backdrop + 3 * i;
+            const unsigned char* s = source + source_channels * i;
+            int source_alpha = source_channels == 4 ? div255(s[3] * opacity) : opacity;
+            for (int c = 0; c < 3; c++)
+            {
+                b[c] = div255(source_alpha * blend_channel<MODE>(b[c], s[c]) + (255 - source_alpha) * b[c]);
+            }
+        }
+        return;
+    }
+
+    for (int i = 0; i < count; i++)
+    {
+        unsigned char* b = backdrop + 4 * i;
+        const unsigned char* s = source + source_channels * i;
+        int source_alpha = source_channels == 4 ? div255(s[3] * opacity) : opacity;
+        int backdrop_alpha = b[3];
+
+        // Alphas and colors in 255ths of a level until the final division, so rounding happens only once
+        int covered_alpha = backdrop_alpha * (255 - source_alpha);
+        int result_alpha = 255 * source_alpha + covered_alpha;
+        if (result_alpha == 0)
+        {
+            continue;
+        }
+        for (int c = 0; c < 3; c++)
+        {
+            // The blend only applies where the image is opaque, elsewhere the overlay shows as is
+            int mixed = (255 - backdrop_alpha) * s[c] + backdrop_alpha * blend_channel<MODE>(b[c], s[c]);
+            b[c] = (source_alpha * mixed + covered_alpha * b[c] + result_alpha / 2) / result_alpha;
+        }
+        b[3] = div255(result_alpha);
+    }
+}
+
+/**
+ * Description - Composites an overlay (for example a watermark) onto an image in place, with the overlay's top
+ * left corner at (x, y). Only the overlapping rectangle is touched and neither image is copied. An overlay
+ * with 3 channels is opaque. Rows are split across threads.
+ * @param image   the image to draw on
+ * @param overlay the image drawn on top
+ * @param x       left column of the overlay, may be negative or past the edge
+ * @param y       top row of the overlay, may be negative or past the edge
+ * @param mode    the Blend_Mode
+ * @param opacity overall opacity of the overlay, 0-1
+ */
+void composite(Image_Buffer& image, const Image_Buffer& overlay, int x, int y, int mode, double opacity = 1)
+{
+    int first_col = max(0, x);
+    int end_col = min(image.width, x + overlay.width);
+    int first_row = max(0, y);
+    int end_row = min(image.height, y + overlay.height);
+    if (first_col >= end_col || first_row >= end_row)
+    {
+        return;
+    }
+
+    PROFILE_STAGE("composite", (long long)(end_col - first_col) * (end_row - first_row) * (2 * image.channels + overlay.channels));
+    int alpha_scale = lround(min(max(opacity, 0.0), 1.0) * 255);
+    auto kernel = mode == Blend_Multiply ? composite_row<Blend_Multiply>
+                : mode == Blend_Screen ? composite_row<Blend_Screen>
+                : mode == Blend_Overlay ? composite_row<Blend_Overlay>
+                : composite_row<Blend_Over>;
+
+    parallel_rows(end_row - first_row, [&](int first, int end)
+    {
+        for (int row = first_row + first; row < first_row + end; row++)
+        {
+            kernel(image.row(row) + (size_t)first_col * image.channels, image.channels,
+                   overlay.row(row - y) + (size_t)(first_col - x) * overlay.channels, overlay.channels,
+                   end_col - first_col, alpha_scale);
+        }
+    });
+}
+
+/**
+ * Description - Composite wrapper function. Takes the input filename, asks for an overlay image, its position,
+ * blend mode and opacity, composites it onto the input and writes the result (32-bit if the input has alpha).
+ * @param input_filename BMP image filename
+ */
+void composite_wrapper(string input_filename)
+{
+    string output_filename = "";
+    string overlay_filename = "";
+    Image_Buffer image;
+    Image_Buffer overlay;
+    int x = 0;
+    int y = 0;
+    int mode = Blend_Over;
+    double opacity = 1;
+    bool success = true;
+
+    cout << "Composite overlay selected" << endl << "Enter output BMP filename: ";
+    cin >> output_filename;
+    cout << "Enter overlay BMP filename: ";
+    cin >> overlay_filename;
+    cout << "Enter overlay position x y: ";
+    cin >> x >> y;
+    cout << "Enter blend mode (0 = over, 1 = multiply, 2 = screen, 3 = overlay): ";
+    cin >> mode;
+    cout << "Enter opacity (0-1): ";
+    cin >> opacity;
+
+    success = read_image_fast(input_filename, image) && read_image_fast(overlay_filename, overlay);
+    if (success == true)
+    {
+        composite(image, overlay, x, y, mode, opacity);
+        success = write_image_fast(output_filename, image);
+    }
+
+    if (success == true)
+    {cout << "Successfully composited!" << endl;}
+    else
+    {cout << "Composite failed" << endl;}
+}
+
+/**
+ * Description - Creates a deterministic 4 channel test overlay: the test image with alpha rising diagonally
+ * from transparent to opaque
+ * @param width  width in pixels
+ * @param height height in pixels
+ * @return the overlay
+ */
+Image_Buffer make_test_overlay(int width, int height)
+{
+    Image_Buffer colors = make_test_image(width, height);
+    Image_Buffer overlay = make_buffer(width, height, 4);
+    for (int row = 0; row < height; row++)
+    {
+        for (int col = 0; col < width; col++)
+        {
+            copy_n(colors.row(row) + 3 * col, 3, overlay.row(row) + 4 * col);
+            overlay.row(row)[4 * col + 3] = (col + row) * 255 / max(1, width + height - 2);
+        }
+    }
+    return overlay;
+}
+
+/**
+ * Description - Benchmarks compositing a 1024x1024 RGBA overlay in every blend mode onto an opaque image and onto
+ * an image with alpha, against a per-pixel floating point "over"
+ * @param image the test image
+ */
+void benchmark_blend(const Image_Buffer& image)
+{
+    Image_Buffer overlay = make_test_overlay(1024, 1024);
+    Image_Buffer opaque = image;
+    Image_Buffer transparent = make_buffer(image.width, image.height, 4);
+    for (size_t i = 0, count = (size_t)image.width * image.height; i < count; i++)
+    {
+        copy_n(&image.data[3 * i], 3, &transparent.data[4 * i]);
+        transparent.data[4 * i + 3] = i % 256;
+    }
+    double megapixels = (double)min(image.width, overlay.width) * min(image.height, overlay.height) / 1e6;
+    cout << "Blend benchmark, 1024x1024 RGBA overlay on " << image.width << "x" << image.height << ", " << worker_count() << " threads" << endl;
+
+    for (int mode = Blend_Over; mode <= Blend_Overlay; mode++)
+    {
+        double opaque_ms = time_ms([&]() { composite(opaque, overlay, 0, 0, mode, 0.8); }, 5);
+        double transparent_ms = time_ms([&]() { composite(transparent, overlay, 0, 0, mode, 0.8); }, 5);
+        cout << "  " << BLEND_NAMES[mode] << ": RGB image " << megapixels / opaque_ms * 1000 << " Mpixels/s, RGBA image "
+             << megapixels / transparent_ms * 1000 << " Mpixels/s" << endl;
+    }
+
+    double naive_ms = time_ms([&]()
+    {
+        for (int row = 0; row < min(opaque.height, overlay.height); row++)
+        {
+            for (int col = 0; col < min(opaque.width, overlay.width); col++)
+            {
+                const unsigned char* s = overlay.row(row) + 4 * col;
+                unsigned char* b = opaque.row(row) + 3 * col;
+                float alpha = s[3] / 255.0f * 0.8f;
+                for (int c = 0; c < 3; c++)
+                {
+                    b[c] = lround(alpha * s[c] + (1 - alpha) * b[c]);
+                }
+            }
+        }
+    }, 5);
+    cout << "  floating point over, RGB image " << megapixels / naive_ms * 1000 << " Mpixels/s" << endl;
+}
+
+//
+// INCREMENTAL RE-RENDER
+//
+
+/**
+ * Description - Keeps Clarendon (2), lighten (8) or darken (9) of one image up to date while the scaling factor
+ * is tuned or the source is edited, redoing only the work a change affects. The output byte of these filters
+ * depends only on the input byte, the factor and (for Clarendon) whether the pixel is light, dark or in between.
+ * So the pixel classes are cached, the factor only feeds three 256 entry lookup tables, and each 64x64 tile
+ * remembers which byte values it holds per class. A new factor re-renders only the tiles holding a value whose
+ * table entry changed; an edit re-classifies and re-renders only the tiles it touches. Output is identical to
+ * process_2, process_8 and process_9.
+ */
+class Incremental_Filter
+{
+public:
+    static const int TILE = 64;
+
+    /**
+     * Description - Renders the filter once in full
+     * @param source         the image to filter
+     * @param filter         2, 8 or 9
+     * @param scaling_factor the initial scaling factor
+     */
+    Incremental_Filter(const Image_Buffer& source, int filter, double scaling_factor)
+        : image(source), filter(filter), factor(scaling_factor)
+    {
+        output = make_buffer(image.width, image.height, image.channels);
+        pixel_class.resize((size_t)image.width * image.height);
+        tiles_across = (image.width + TILE - 1) / TILE;
+        tiles_down = (image.height + TILE - 1) / TILE;
+        tiles.resize(tiles_across * tiles_down);
+        for (Tile& tile : tiles)
+        {
+            tile.classify = true;
+            tile.render = true;
+        }
+        build_tables(tables);
+    }
+
+    /**
+     * Description - Changes the scaling factor. Only tiles holding a byte value that now maps differently are
+     * marked for re-rendering.
+     * @param scaling_factor the new scaling factor
+     */
+    void set_factor(double scaling_factor)
+    {
+        factor = scaling_factor;
+        unsigned char new_tables[CLASSES][256];
+        build_tables(new_tables);
+        bitset<256> changed[CLASSES];
+        for (int k = 0; k < CLASSES; k++)
+        {
+            for (int value = 0; value < 256; value++)
+            {
+                changed[k][value] = new_tables[k][value] != tables[k][value];
+            }
+        }
+        memcpy(tables, new_tables, sizeof(tables));
+        for (Tile& tile : tiles)
+        {
+            for (int k = 0; k < CLASSES; k++)
+            {
+                tile.render = tile.render || (tile.values[k] & changed[k]).any();
+            }
+        }
+    }
+
+    /**
+     * Description - The source image, for editing in place. Call mark_dirty() on the edited area afterwards.
+     * @return the source image
+     */
+    Image_Buffer& source() { return image; }
+
+    /**
+     * Description - Marks an edited area of the source so its tiles are re-classified and re-rendered
+     * @param x      left column
+     * @param y      top row
+     * @param width  width in pixels
+     * @param height height in pixels
+     */
+    void mark_dirty(int x, int y, int width, int height)
+    {
+        int first_col = max(0, x) / TILE;
+        int end_col = min(tiles_across, (min(image.width, x + width) + TILE - 1) / TILE);
+        int first_row = max(0, y) / TILE;
+        int end_row = min(tiles_down, (min(image.height, y + height) + TILE - 1) / TILE);
+        for (int tile_row = first_row; tile_row < end_row; tile_row++)
+        {
+            for (int tile_col = first_col; tile_col < end_col; tile_col++)
+            {
+                tiles[tile_row * tiles_across + tile_col].classify = true;
+                tiles[tile_row * tiles_across + tile_col].render = true;
+            }
+        }
+    }
+
+    /**
+     * Description - Brings the output up to date, rendering the pending tiles across the worker threads
+     * @return the filtered image
+     */
+    const Image_Buffer& result()
+    {
+        vector<int> pending;
+        for (size_t i = 0; i < tiles.size(); i++)
+        {
+            if (tiles[i].render)
+            {
+                pending.push_back(i);
+            }
+        }
+        parallel_rows(pending.size(), [&](int first, int end)
+        {
+            for (int i = first; i < end; i++)
+            {
+                render_tile(pending[i]);
+            }
+        });
+        tiles_rendered = pending.size();
+        return output;
+    }
+
+    int tile_count() const { return tiles.size(); }
+
+    // Number of tiles the last result() call rendered
+    int tiles_rendered = 0;
+
+private:
+    // Pixel classes: left as is, lightened, darkened
+    enum { Unchanged = 0, Lightened, Darkened, CLASSES };
+
+    struct Tile
+    {
+        bitset<256> values[CLASSES];    // Byte values present per pixel class
+        bool classify = false;
+        bool render = false;
+    };
+
+    /**
+     * Description - Fills the per-class lookup tables for the current factor, narrowing exactly like the
+     * vector of vector of Pixels path: double to int, then int to byte
+     * @param table the tables to fill
+     */
+    void build_tables(unsigned char table[CLASSES][256]) const
+    {
+        for (int value = 0; value < 256; value++)
+        {
+            table[Unchanged][value] = value;
+            table[Lightened][value] = (unsigned char)(int)(255 - (255 - value) * factor);
+            table[Darkened][value] = (unsigned char)(int)(value * factor);
+        }
+    }
+
+    /**
+     * Description - Re-classifies a tile if needed and writes its output pixels
+     * @param index the tile index
+     */
+    void render_tile(int index)
+    {
+        Tile& tile = tiles[index];
+        int first_col = index % tiles_across * TILE;
+        int end_col = min(image.width, first_col + TILE);
+        int first_row = index / tiles_across * TILE;
+        int end_row = min(image.height, first_row + TILE);
+        int channels = image.channels;
+
+        if (tile.classify)
+        {
+            for (int k = 0; k < CLASSES; k++)
+            {
+                tile.values[k].reset();
+            }
+            for (int row = first_row; row < end_row; row++)
+            {
+                const unsigned char* in = image.row(row);
+                unsigned char* classes = pixel_class.data() + (size_t)row * image.width;
+                for (int col = first_col; col < end_col; col++)
+                {
+                    const unsigned char* pixel = in + col * channels;
+                    int k = filter == 8 ? Lightened : filter == 9 ? Darkened : Unchanged;
+                    if (filter == 2)
+                    {
+                        int average_value = luma(pixel[0], pixel[1], pixel[2], Luma_Average);
+                        k = average_value >= 170 ? Lightened : average_value < 90 ? Darkened : Unchanged;
+                    }
+                    classes[col] = k;
+                    for (int c = 0; c < 3; c++)
+                    {
+                        tile.values[k][pixel[c]] = true;
+                    }
+                }
+            }
+            tile.classify = false;
+        }
+
+        for (int row = first_row; row < end_row; row++)
+        {
+            const unsigned char* in = image.row(row);
+            const unsigned char* classes = pixel_class.data() + (size_t)row * image.width;
+            unsigned char* out = output.row(row);
+            for (int col = first_col; col < end_col; col++)
+            {
+                const unsigned char* table = tables[classes[col]];
+                for (int c = 0; c < channels; c++)
+                {
+                    // Alpha passes through unchanged
+                    out[col * channels + c] = c < 3 ? table[in[col * channels + c]] : in[col * channels + c];
+                }
+            }
+        }
+        tile.render = false;
+    }
+
+    Image_Buffer image;
+    Image_Buffer output;
+    int filter;
+    double factor;
+    unsigned char tables[CLASSES][256];
+    vector<unsigned char> pixel_class;
+    vector<Tile> tiles;
+    int tiles_across = 0;
+    int tiles_down = 0;
+};
+
+/**
+ * Description - Interactive tuning wrapper. Reads the image once, then re-renders Clarendon, lighten or darken
+ * for every scaling factor entered, writing the output file each time, until a negative factor is entered.
+ * @param input_filename BMP image filename
+ */
+void tune_filter_wrapper(string input_filename)
+{
+    string output_filename = "";
+    Image_Buffer image;
+    int filter = 2;
+    double scaling_factor = 1;
+
+    cout << "Tune Clarendon, lighten or darken selected" << endl << "Enter output BMP filename: ";
+    cin >> output_filename;
+    cout << "Enter filter (2 = Clarendon, 8 = lighten, 9 = darken): ";
+    cin >> filter;
+    if ((filter != 2 && filter != 8 && filter != 9) || !read_image_fast(input_filename, image))
+    {
+        cout << "Tuning failed" << endl;
+        return;
+    }
+
+    Incremental_Filter session(image, filter, scaling_factor);
+    while (true)
+    {
+        cout << "Enter scaling factor (negative to finish): ";
+        if (!(cin >> scaling_factor) || scaling_factor < 0)
+        {
+            break;
+        }
+        session.set_factor(scaling_factor);
+        const Image_Buffer* result = nullptr;
+        double render_ms = time_ms([&]() { result = &session.result(); }, 1);
+        if (!write_image_fast(output_filename, *result))
+        {
+            cout << "Tuning failed" << endl;
+            return;
+        }
+        cout << "Rendered " << session.tiles_rendered << " of " << session.tile_count() << " tiles in "
+             << render_ms << " ms" << endl;
+    }
+    cout << "Finished tuning!" << endl;
+}
+
+/**
+ * Description - Checks that Incremental_Filter matches process_2, process_8 and process_9 after factor changes
+ * and source edits
+ * @return True if every check passed and false otherwise
+ */
+bool check_incremental_filters()
+{
+    bool passed = true;
+    Image_Buffer image = make_test_image(150, 97);
+    const int FILTERS[] = {2, 8, 9};
+    for (int filter : FILTERS)
+    {
+        Incremental_Filter session(image, filter, 0.7);
+        const double FACTORS[] = {0.7, 0.72, 1.3, 0.2};
+        for (int step = 0; step < 5; step++)
+        {
+            if (step < 4)
+            {
+                session.set_factor(FACTORS[step]);
+            }
+            else
+            {
+                // Paint a bright square across several tiles
+                for (int row = 50; row < 90; row++)
+                {
+                    fill_n(session.source().row(row) + 60 * 3, 30 * 3, 230);
+                }
+                session.mark_dirty(60, 50, 30, 40);
+            }
+            vector<vector<Pixel>> pixels = buffer_to_pixels(session.source());
+            double factor = FACTORS[min(step, 3)];
+            vector<vector<Pixel>> expected = filter == 2 ? process_2(pixels, factor) : filter == 8 ? process_8(pixels, factor) : process_9(pixels, factor);
+            if (session.result().data != pixels_to_buffer(expected).data)
+            {
+                cout << "  FAILED filter " << filter << " step " << step << endl;
+                passed = false;
+            }
+        }
+    }
+    cout << "  incremental Clarendon, lighten and darken match: " << (passed ? "yes" : "NO") << endl;
+    return passed;
+}
+
+/**
+ * Description - Benchmarks incremental re-rendering against running process_2 from scratch: the first render,
+ * a small factor change and an edit of a 32x32 area
+ * @param image the test image
+ */
+void benchmark_incremental(const Image_Buffer& image)
+{
+    cout << "Incremental benchmark on " << image.width << "x" << image.height << ", Clarendon, " << worker_count() << " threads" << endl;
+    vector<vector<Pixel>> pixels = buffer_to_pixels(image);
+    double full_ms = time_ms([&]() { process_2(pixels, 1.2); }, 3);
+    Incremental_Filter session(image, 2, 1.2);
+    double first_ms = time_ms([&]() { session.result(); }, 1);
+    double factor = 1.2;
+    double tweak_ms = time_ms([&]() { session.set_factor(factor += 0.01); session.result(); }, 3);
+    int tweak_tiles = session.tiles_rendered;
+    double edit_ms = time_ms([&]()
+    {
+        for (int row = 100; row < 132; row++)
+        {
+            fill_n(session.source().row(row) + 100 * 3, 32 * 3, 200);
+        }
+        session.mark_dirty(100, 100, 32, 32);
+        session.result();
+    }, 3);
+    int edit_tiles = session.tiles_rendered;
+    cout << "  process_2 from scratch " << full_ms << " ms" << endl;
+    cout << "  first incremental render " << first_ms << " ms" << endl;
+    cout << "  factor change " << tweak_ms << " ms (" << tweak_tiles << " of " << session.tile_count() << " tiles)" << endl;
+    cout << "  32x32 edit " << edit_ms << " ms (" << edit_tiles << " of " << session.tile_count() << " tiles)" << endl;
+}
+
+//
+// FILTERS ON IMAGE BUFFERS
+//
+
+/**
+ * Description - Applies one of the single image menu filters (1-10, 12-15, 18, 19) to an image buffer.
+ * Filter 0 copies the image unchanged, which turns --apply into a format converter. A 32-bit image keeps its
+ * alpha channel, except through filters 4-6 which change the size on vectors of Pixels.
+ * @param image   the input image
+ * @param filter  the menu number of the filter
+ * @param param_1 first parameter (scaling factor, number of 90 degree rotations, X scale, saturation, hue shift,
+ *                dither mode, flip mode, rotation angle or denoise radius)
+ * @param param_2 second parameter (Y scale, rotation sampling or bilateral color sigma)
+ * @param result  the output image
+ * @return True if successful and false if the filter or its parameters are invalid
+ */
+bool apply_filter(const Image_Buffer& image, int filter, double param_1, double param_2, Image_Buffer& result)
+{
+    if (image.width <= 0 || image.height <= 0)
+    {
+        return false;
+    }
+
+    if (filter == 0)
+    {
+        result = image;
+        return true;
+    }
+
+    vector<vector<Pixel>> pixels = filter <= 10 ? buffer_to_pixels(image) : vector<vector<Pixel>>();
+    switch (filter)
+    {
+    case 1: pixels = process_1(pixels); break;
+    case 2: pixels = process_2(pixels, param_1); break;
+    case 3: pixels = process_3(pixels); break;
+    case 4: pixels = process_4(pixels); break;
+    case 5:
+        if (!isfinite(param_1))
+        {
+            return false;
+        }
+        pixels = process_5(pixels, quarter_turns(param_1));
+        break;
+    case 6:
+        // The enlarged image is held to the same pixel limit as decoded images
+        if (param_1 < 1 || param_2 < 1 || (double)image.width * image.height * (int)param_1 * (int)param_2 > decode_limits.max_pixels)
+        {
+            return false;
+        }
+        pixels = process_6(pixels, (int)param_1, (int)param_2);
+        break;
+    case 7:
+    case 10:
+        // param_1 is the Dither_Mode; without dithering the original per-pixel threshold is used
+        if (!(param_1 >= No_Dither && param_1 < Ordered_Bayer + 1))
+        {
+            return false;
+        }
+        if ((int)param_1 != No_Dither)
+        {
+            result = filter == 7 ? quantize_high_contrast(image, (int)param_1) : quantize_five_colors(image, (int)param_1);
+            keep_alpha(image, result);
+            return true;
+        }
+        pixels = filter == 7 ? process_7(pixels) : process_10(pixels);
+        break;
+    case 8: pixels = process_8(pixels, param_1); break;
+    case 9: pixels = process_9(pixels, param_1); break;
+    case 12: result = process_12(image, param_1); return true;
+    case 13: result = process_13(image, param_1); return true;
+    case 14:
+        // Any other mode would size the result as a flip but write it as a transpose
+        if (!(param_1 >= Flip_Horizontal && param_1 < Flip_Transpose + 1))
+        {
+            return false;
+        }
+        result = process_14(image, (int)param_1);
+        return true;
+    case 15:
+        if (!isfinite(param_1) || !(param_2 >= Nearest_Sampling && param_2 < Bilinear_Sampling + 1))
+        {
+            return false;
+        }
+        result = process_15(image, param_1, (int)param_2);
+        return true;
+    case 18:
+    case 19:
+        // Both keep alpha themselves; radii outside 1-127 (median) or 1-64 (bilateral) are not clamped silently
+        if (!(param_1 >= 1 && param_1 < (filter == 18 ? 128 : 65)))
+        {
+            return false;
+        }
+        result = filter == 18 ? process_18(image, (int)param_1) : process_19(image, (int)param_1, param_2);
+        return true;
+    default: return false;
+    }
+
+    // The vector of vector of Pixels filters have no alpha; it is put back when the size did not change
+    result = pixels_to_buffer(pixels);
+    keep_alpha(image, result);
+    return true;
+}
+
+//
+// HIGH PRECISION TONE CHAINS
+//
+
+// One step of a tone chain: Clarendon (2), lighten (8) or darken (9) with its scaling factor
+struct Tone_Step
+{
+    int filter;
+    double factor;
+};
+
+/**
+ * Description - Splits a row of pixels into float red, green and blue planes
+ * @param in    the input pixels
+ * @param red   the red plane
+ * @param green the green plane
+ * @param blue  the blue plane
+ * @param count number of pixels
+ */
+template <int CHANNELS>
+void bytes_to_planes_row(const unsigned char* in, float* red, float* green, float* blue, int count)
+{
+    for (int i = 0; i < count; i++)
+    {
+        red[i] = in[i * CHANNELS];
+        green[i] = in[i * CHANNELS + 1];
+        blue[i] = in[i * CHANNELS + 2];
+    }
+}
+
+/**
+ * Description - Clamps a float to 0-255. max(value, 0) is (value + |value|) / 2 and min(value, 255) is built the
+ * same way: compilers do not turn float comparisons into vector max and min unless -fno-trapping-math is given,
+ * but they do vectorize fabs.
+ * @param value the value
+ * @return the clamped value
+ */
+inline float clamp_float_byte(float value)
+{
+    value = 0.5f * (value + fabsf(value));
+    return 255 - 0.5f * ((255 - value) + fabsf(255 - value));
+}
+
+/**
+ * Description - Rounds and clamps float red, green and blue planes back into a row of pixels. Only red, green
+ * and blue are written.
+ * @param red   the red plane
+ * @param green the green plane
+ * @param blue  the blue plane
+ * @param out   the output pixels
+ * @param count number of pixels
+ */
+template <int CHANNELS>
+void planes_to_bytes_row(const float* red, const float* green, const float* blue, unsigned char* out, int count)
+{
+    for (int i = 0; i < count; i++)
+    {
+        out[i * CHANNELS]     = (int)(clamp_float_byte(red[i]) + 0.5f);
+        out[i * CHANNELS + 1] = (int)(clamp_float_byte(green[i]) + 0.5f);
+        out[i * CHANNELS + 2] = (int)(clamp_float_byte(blue[i]) + 0.5f);
+    }
+}
+
+/**
+ * Description - Applies one tone step to float planes. Every filter is v = offset - (offset - v) * scale:
+ * lighten uses offset 255, darken offset 0, and Clarendon picks per pixel from the channel sum (a sum of 510
+ * or more is an average of at least 170, below 270 an average under 90). The selects keep the loop branch free.
+ * @param step  the step
+ * @param red   the red plane
+ * @param green the green plane
+ * @param blue  the blue plane
+ * @param count number of pixels
+ */
+void tone_step_row(const Tone_Step& step, float* red, float* green, float* blue, int count)
+{
+    float factor = step.factor;
+    for (int i = 0; i < count; i++)
+    {
+        float sum = red[i] + green[i] + blue[i];
+        bool light = step.filter == 8 || (step.filter == 2 && sum >= 510);
+        bool dark = step.filter == 9 || (step.filter == 2 && sum < 270);
+        float offset = light ? 255.0f : 0.0f;
+        float scale = light || dark ? factor : 1.0f;
+        red[i] = offset - (offset - red[i]) * scale;
+        green[i] = offset - (offset - green[i]) * scale;
+        blue[i] = offset - (offset - blue[i]) * scale;
+    }
+}
+
+/**
+ * Description - Applies a chain of Clarendon, lighten and darken steps in one pass. Each row is split into float
+ * planes, goes through every step while it is in cache, and is rounded and clamped once at the end. Running the
+ * filters one after another instead truncates to int and wraps to a byte after every step.
+ * @param image  the input image
+ * @param steps  the steps, applied in order
+ * @param result the output image
+ * @return True if successful and false if a step is not filter 2, 8 or 9
+ */
+bool apply_tone_chain(const Image_Buffer& image, const vector<Tone_Step>& steps, Image_Buffer& result)
+{
+    for (const Tone_Step& step : steps)
+    {
+        if (step.filter != 2 && step.filter != 8 && step.filter != 9)
+        {
+            return false;
+        }
+    }
+    PROFILE_STAGE("tone chain", image.data.size() * 2);
+    result = make_buffer(image.width, image.height, image.channels);
+
+    parallel_rows(image.height, [&](int first_row, int end_row)
+    {
+        vector<float> planes(3 * image.width);
+        float* red = planes.data();
+        float* green = red + image.width;
+        float* blue = green + image.width;
+        for (int row = first_row; row < end_row; row++)
+        {
+            if (image.channels == 4)
+            { bytes_to_planes_row<4>(image.row(row), red, green, blue, image.width); }
+            else
+            { bytes_to_planes_row<3>(image.row(row), red, green, blue, image.width); }
+            for (const Tone_Step& step : steps)
+            {
+                tone_step_row(step, red, green, blue, image.width);
+            }
+            if (image.channels == 4)
+            { planes_to_bytes_row<4>(red, green, blue, result.row(row), image.width); }
+            else
+            { planes_to_bytes_row<3>(red, green, blue, result.row(row), image.width); }
+        }
+    });
+    keep_alpha(image, result);
+    return true;
+}
+
+/**
+ * Description - Double precision tone chain, one pixel at a time, for checking the float path
+ * @param image the input image
+ * @param steps the steps, applied in order
+ * @return the new image
+ */
+Image_Buffer tone_chain_reference(const Image_Buffer& image, const vector<Tone_Step>& steps)
+{
+    Image_Buffer result = image;
+    for (size_t i = 0, count = (size_t)image.width * image.height; i < count; i++)
+    {
+        double values[3];
+        for (int c = 0; c < 3; c++)
+        {
+            values[c] = image.data[i * image.channels + c];
+        }
+        for (const Tone_Step& step : steps)
+        {
+            double average_value = (values[0] + values[1] + values[2]) / 3;
+            bool light = step.filter == 8 || (step.filter == 2 && average_value >= 170);
+            bool dark = step.filter == 9 || (step.filter == 2 && average_value < 90);
+            for (int c = 0; c < 3; c++)
+            {
+                values[c] = light ? 255 - (255 - values[c]) * step.factor : (dark ? values[c] * step.factor : values[c]);
+            }
+        }
+        for (int c = 0; c < 3; c++)
+        {
+            result.data[i * image.channels + c] = lround(min(max(values[c], 0.0), 255.0));
+        }
+    }
+    return result;
+}
+
+/**
+ * Description - Applies a tone chain one filter at a time through apply_filter, the 8-bit path
+ * @param image the input image
+ * @param steps the steps, applied in order
+ * @return the new image
+ */
+Image_Buffer tone_chain_8bit(const Image_Buffer& image, const vector<Tone_Step>& steps)
+{
+    Image_Buffer result = image;
+    for (const Tone_Step& step : steps)
+    {
+        Image_Buffer next;
+        apply_filter(result, step.filter, step.factor, 0, next);
+        result = move(next);
+    }
+    return result;
+}
+
+/**
+ * Description - Largest and mean per channel difference between two images of the same size
+ * @param a       the first image
+ * @param b       the second image
+ * @param largest the largest difference
+ * @return the mean difference
+ */
+double channel_difference(const Image_Buffer& a, const Image_Buffer& b, int& largest)
+{
+    long long total = 0;
+    largest = 0;
+    for (size_t i = 0; i < a.data.size(); i++)
+    {
+        int difference = abs(a.data[i] - b.data[i]);
+        total += difference;
+        largest = max(largest, difference);
+    }
+    return (double)total / max<size_t>(a.data.size(), 1);
+}
+
+/**
+ * Description - Checks that single float steps are within one level of the 8-bit filters (which truncate where
+ * the float path rounds) and that longer chains are within one level of double precision
+ * @return True if every check passed and false otherwise
+ */
+bool check_tone_chains()
+{
+    bool passed = true;
+    Image_Buffer image = make_test_image(150, 97);
+    const Tone_Step SINGLE[] = {{2, 0.3}, {2, 0.9}, {8, 0.5}, {8, 0.95}, {9, 0.5}, {9, 0.05}};
+    for (const Tone_Step& step : SINGLE)
+    {
+        Image_Buffer chained;
+        Image_Buffer filtered;
+        int largest = 0;
+        apply_tone_chain(image, {step}, chained);
+        apply_filter(image, step.filter, step.factor, 0, filtered);
+        channel_difference(chained, filtered, largest);
+        if (largest > 1)
+        {
+            cout << "  FAILED filter " << step.filter << " factor " << step.factor << ": off by " << largest << endl;
+            passed = false;
+        }
+    }
+
+    const vector<Tone_Step> CHAINS[] = {{{9, 0.6}, {8, 0.6}, {2, 1.3}}, {{9, 1.8}, {9, 0.5}, {2, 0.7}}, {{8, 0.4}, {2, 1.5}, {9, 0.9}, {8, 1.2}}};
+    for (const vector<Tone_Step>& steps : CHAINS)
+    {
+        Image_Buffer chained;
+        int largest = 0;
+        apply_tone_chain(image, steps, chained);
+        channel_difference(chained, tone_chain_reference(image, steps), largest);
+        if (largest > 1)
+        {
+            cout << "  FAILED chain of " << steps.size() << " steps: off by " << largest << endl;
+            passed = false;
+        }
+    }
+    cout << "  float tone chains match the 8-bit filters and double precision: " << (passed ? "yes" : "NO") << endl;
+    return passed;
+}
+
+/**
+ * Description - Benchmarks darken, lighten and Clarendon chained through the 8-bit filters against the fused
+ * float chain, reports how far each lands from double precision, and times the conversion kernels alone
+ * @param image the test image
+ */
+void benchmark_tone_chain(const Image_Buffer& image)
+{
+    const vector<Tone_Step> steps = {{9, 0.6}, {8, 0.6}, {2, 1.3}};
+    double megapixels = (double)image.width * image.height / 1e6;
+    cout << "Tone chain benchmark on " << image.width << "x" << image.height << ", darken 0.6, lighten 0.6, Clarendon 1.3, "
+         << worker_count() << " threads" << endl;
+
+    Image_Buffer eight_bit;
+    Image_Buffer chained;
+    double eight_bit_ms = time_ms([&]() { eight_bit = tone_chain_8bit(image, steps); }, 3);
+    double chained_ms = time_ms([&]() { apply_tone_chain(image, steps, chained); }, 3);
+    Image_Buffer converted = make_buffer(image.width, image.height, image.channels);
+    double convert_ms = time_ms([&]()
+    {
+        parallel_rows(image.height, [&](int first_row, int end_row)
+        {
+            vector<float> planes(3 * image.width);
+            float* red = planes.data();
+            for (int row = first_row; row < end_row; row++)
+            {
+                bytes_to_planes_row<3>(image.row(row), red, red + image.width, red + 2 * image.width, image.width);
+                planes_to_bytes_row<3>(red, red + image.width, red + 2 * image.width, converted.row(row), image.width);
+            }
+        });
+    }, 3);
+
+    Image_Buffer reference = tone_chain_reference(image, steps);
+    int eight_bit_largest = 0;
+    int chained_largest = 0;
+    double eight_bit_mean = channel_difference(eight_bit, reference, eight_bit_largest);
+    double chained_mean = channel_difference(chained, reference, chained_largest);
+    cout << "  8-bit filters " << megapixels / eight_bit_ms * 1000 << " Mpixels/s, off from double precision by "
+         << eight_bit_mean << " mean, " << eight_bit_largest << " max" << endl;
+    cout << "  float chain " << megapixels / chained_ms * 1000 << " Mpixels/s, off from double precision by "
+         << chained_mean << " mean, " << chained_largest << " max" << endl;
+    cout << "  byte to float planes and back " << megapixels / convert_ms * 1000 << " Mpixels/s" << endl;
+}
+
+//
+// PROCESSING SERVER
+//
+// Requests and replies are small fixed size messages on a Unix domain socket. Pixel data is exchanged through
+// memfd shared memory: each side owns one segment per connection, and its file descriptor is only sent again
+// when the segment had to grow, so a request costs one message each way and no temporary files.
+//
+
+// Request from the client; the input pixels are in the client's segment
+struct Server_Request
+{
+    int filter;
+    int width;
+    int height;
+    int channels;
+    double param_1;
+    double param_2;
+    int new_segment;
+};
+
+// Reply from the server; the output pixels are in the server's segment
+struct Server_Reply
+{
+    int success;
+    int width;
+    int height;
+    int channels;
+    int new_segment;
+};
+
+#ifdef __linux__
+
+// Shared memory segment backed by a memfd and mapped into this process
+struct Shared_Buffer
+{
+    int fd = -1;
+    size_t size = 0;
+    unsigned char* bytes = nullptr;
+};
+
+/**
+ * Description - Makes sure the segment owned by this process holds at least size bytes
+ * @param buffer the shared buffer
+ * @param size   the number of bytes needed
+ * @return True if the segment was created or grown (the other side must map it again)
+ */
+bool shared_buffer_reserve(Shared_Buffer& buffer, size_t size)
+{
+    if (buffer.fd >= 0 && buffer.size >= size)
+    {
+        return false;
+    }
+    if (buffer.fd < 0)
+    {
+        buffer.fd = memfd_create("image", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    }
+    if (buffer.bytes != nullptr)
+    {
+        munmap(buffer.bytes, buffer.size);
+        buffer.bytes = nullptr;
+    }
+    buffer.size = size;
+    // Sealed against shrinking, so the other side cannot truncate the segment under our mapping (SIGBUS)
+    if (buffer.fd < 0 || ftruncate(buffer.fd, size) != 0 || fcntl(buffer.fd, F_ADD_SEALS, F_SEAL_SHRINK) != 0)
+    {
+        buffer.size = 0;
+        return true;
+    }
+    void* bytes = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, buffer.fd, 0);
+    buffer.bytes = bytes == MAP_FAILED ? nullptr : (unsigned char*)bytes;
+    return true;
+}
+
+/**
+ * Description - Maps a segment received from the other side, replacing any previous mapping. Segments that are not
+ * sealed against shrinking are refused, since truncating one while it is mapped would crash this process.
+ * @param buffer the shared buffer
+ * @param fd     the received file descriptor (closed once mapped)
+ */
+void shared_buffer_attach(Shared_Buffer& buffer, int fd)
+{
+    if (buffer.bytes != nullptr)
+    {
+        munmap(buffer.bytes, buffer.size);
+    }
+    buffer.bytes = nullptr;
+    buffer.size = 0;
+
+    struct stat info;
+    int seals = fcntl(fd, F_GET_SEALS);
+    if (seals >= 0 && (seals & F_SEAL_SHRINK) && fstat(fd, &info) == 0 && info.st_size > 0)
+    {
+        void* bytes = mmap(nullptr, info.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if (bytes != MAP_FAILED)
+        {
+            buffer.bytes = (unsigned char*)bytes;
+            buffer.size = info.st_size;
+        }
+    }
+    close(fd);
+}
+
+/**
+ * Description - Unmaps and closes a shared buffer
+ * @param buffer the shared buffer
+ */
+void shared_buffer_release(Shared_Buffer& buffer)
+{
+    if (buffer.bytes != nullptr)
+    {
+        munmap(buffer.bytes, buffer.size);
+    }
+    if (buffer.fd >= 0)
+    {
+        close(buffer.fd);
+    }
+    buffer = Shared_Buffer();
+}
+
+/**
+ * Description - Sends a fixed size message, optionally with a file descriptor attached
+ * @param socket_fd the connected socket
+ * @param message   the message bytes
+ * @param size      the message size
+ * @param fd        file descriptor to pass, or -1 for none
+ * @return True if successful and false otherwise
+ */
+bool send_message(int socket_fd, const void* message, size_t size, int fd)
+{
+    iovec io = {(void*)message, size};
+    msghdr header = {};
+    header.msg_iov = &io;
+    header.msg_iovlen = 1;
+
+    char control[CMSG_SPACE(sizeof(int))] = {0};
+    if (fd >= 0)
+    {
+        header.msg_control = control;
+        header.msg_controllen = sizeof(control);
+        cmsghdr* attached = CMSG_FIRSTHDR(&header);
+        attached->cmsg_level = SOL_SOCKET;
+        attached->cmsg_type = SCM_RIGHTS;
+        attached->cmsg_len = CMSG_LEN(sizeof(int));
+        memcpy(CMSG_DATA(attached), &fd, sizeof(int));
+    }
+    return sendmsg(socket_fd, &header, MSG_NOSIGNAL) == (ssize_t)size;
+}
+
+/**
+ * Description - Receives a fixed size message and any file descriptor attached to it
+ * @param socket_fd the connected socket
+ * @param message   where to store the message
+ * @param size      the message size
+ * @param fd        set to the received file descriptor, or -1 for none
+ * @return True if a whole message was received and false when the connection is closed
+ */
+bool receive_message(int socket_fd, void* message, size_t size, int& fd)
+{
+    fd = -1;
+    size_t received = 0;
+    while (received < size)
+    {
+        iovec io = {(char*)message + received, size - received};
+        char control[CMSG_SPACE(sizeof(int))] = {0};
+        msghdr header = {};
+        header.msg_iov = &io;
+        header.msg_iovlen = 1;
+        header.msg_control = control;
+        header.msg_controllen = sizeof(control);
+
+        ssize_t count = recvmsg(socket_fd, &header, MSG_CMSG_CLOEXEC);
+        if (count <= 0)
+        {
+            return false;
+        }
+        for (cmsghdr* attached = CMSG_FIRSTHDR(&header); attached != nullptr; attached = CMSG_NXTHDR(&header, attached))
+        {
+            if (attached->cmsg_level == SOL_SOCKET && attached->cmsg_type == SCM_RIGHTS)
+            {
+                memcpy(&fd, CMSG_DATA(attached), sizeof(int));
+            }
+        }
+        received += count;
+    }
+    return true;
+}
+
+/**
+ * Description - Handles the requests of one client until it disconnects. Requests are held to the decode limits,
+ * and a filter that throws (out of memory) fails only its own request instead of taking the server down.
+ * The shared segments and the input buffer are kept for the whole connection and only grow, so a client sending
+ * images of the same size pays for the allocations once.
+ * @param connection the connected socket
+ */
+void serve_connection(int connection)
+{
+    Shared_Buffer input;
+    Shared_Buffer output;
+    Image_Buffer image;
+    Image_Buffer result;
+    Server_Request request;
+    int fd = -1;
+
+    while (receive_message(connection, &request, sizeof(request), fd))
+    {
+        if (fd >= 0)
+        {
+            shared_buffer_attach(input, fd);
+        }
+
+        Server_Reply reply = {0, 0, 0, 3, 0};
+        long long pixels = (long long)max(request.width, 0) * max(request.height, 0);
+        size_t input_bytes = pixels * request.channels;
+        bool channels_valid = request.channels == 3 || request.channels == 4;
+        if (channels_valid && input.bytes != nullptr && input_bytes > 0 && input_bytes <= input.size &&
+            pixels <= decode_limits.max_pixels && (long long)input_bytes <= decode_limits.max_bytes)
+        {
+            try
+            {
+                image.width = request.width;
+                image.height = request.height;
+                image.channels = request.channels;
+                image.data.assign(input.bytes, input.bytes + input_bytes);
+                reply.success = apply_filter(image, request.filter, request.param_1, request.param_2, result);
+            }
+            catch (const exception&)
+            {
+                reply.success = 0;
+            }
+        }
+
+        if (reply.success)
+        {
+            reply.width = result.width;
+            reply.height = result.height;
+            reply.channels = result.channels;
+            reply.new_segment = shared_buffer_reserve(output, result.data.size());
+            if (output.bytes == nullptr)
+            {
+                reply.success = 0;
+            }
+            else
+            {
+                memcpy(output.bytes, result.data.data(), result.data.size());
+            }
+        }
+        if (!send_message(connection, &reply, sizeof(reply), reply.new_segment ? output.fd : -1))
+        {
+            break;
+        }
+    }
+
+    shared_buffer_release(input);
+    shared_buffer_release(output);
+    close(connection);
+}
+
+/**
+ * Description - Runs the processing server until the process is killed. Each client connection gets its own
+ * thread; the filters themselves share the warm worker pool.
+ * @param socket_path path of the Unix domain socket to listen on
+ * @return the program exit code
+ */
+int run_server(string socket_path)
+{
+    int listener = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    sockaddr_un address = {};
+    address.sun_family = AF_UNIX;
+    if (listener < 0 || socket_path.size() >= sizeof(address.sun_path))
+    {
+        cout << "Could not create socket " << socket_path << endl;
+        return 1;
+    }
+    strcpy(address.sun_path, socket_path.c_str());
+
+    // A socket left behind by an earlier server is replaced, but any other file at the path is left alone
+    struct stat existing;
+    if (lstat(socket_path.c_str(), &existing) == 0)
+    {
+        if (!S_ISSOCK(existing.st_mode))
+        {
+            cout << socket_path << " exists and is not a socket" << endl;
+            return 1;
+        }
+        unlink(socket_path.c_str());
+    }
+    if (::bind(listener, (sockaddr*)&address, sizeof(address)) != 0 || listen(listener, 64) != 0)
+    {
+        cout << "Could not listen on " << socket_path << endl;
+        return 1;
+    }
+
+    worker_pool();
+    cout << "Serving on " << socket_path << " with " << worker_count() << " worker threads" << endl;
+
+    while (true)
+    {
+        int connection = accept4(listener, nullptr, nullptr, SOCK_CLOEXEC);
+        if (connection >= 0)
+        {
+            thread(serve_connection, connection).detach();
+        }
+    }
+}
+
+// Client side of a server connection
+struct Server_Connection
+{
+    int socket_fd = -1;
+    Shared_Buffer input;
+    Shared_Buffer output;
+};
+
+/**
+ * Description - Connects to a running processing server
+ * @param socket_path path of the server's Unix domain socket
+ * @param connection  the connection to set up
+ * @return True if successful and false otherwise
+ */
+bool connect_to_server(string socket_path, Server_Connection& connection)
+{
+    sockaddr_un address = {};
+    address.sun_family = AF_UNIX;
+    if (socket_path.size() >= sizeof(address.sun_path))
+    {
+        return false;
+    }
+    strcpy(address.sun_path, socket_path.c_str());
+    connection.socket_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    return connection.socket_fd >= 0 && connect(connection.socket_fd, (sockaddr*)&address, sizeof(address)) == 0;
+}
+
+/**
+ * Description - Closes a server connection
+ * @param connection the connection
+ */
+void disconnect_from_server(Server_Connection& connection)
+{
+    shared_buffer_release(connection.input);
+    shared_buffer_release(connection.output);
+    if (connection.socket_fd >= 0)
+    {
+        close(connection.socket_fd);
+    }
+    connection.socket_fd = -1;
+}
+
+/**
+ * Description - Asks the server to apply a filter to an image
+ * @param connection the server connection
+ * @param image      the input image
+ * @param filter     the menu number of the filter
+ * @param param_1    first filter parameter
+ * @param param_2    second filter parameter
+ * @param result     the output image
+ * @return True if successful and false otherwise
+ */
+bool server_apply(Server_Connection& connection, const Image_Buffer& image, int filter, double param_1, double param_2, Image_Buffer& result)
+{
+    Server_Request request = {filter, image.width, image.height, image.channels, param_1, param_2, 0};
+    request.new_segment = shared_buffer_reserve(connection.input, image.data.size());
+    if (connection.input.bytes == nullptr)
+    {
+        return false;
+    }
+    memcpy(connection.input.bytes, image.data.data(), image.data.size());
+
+    Server_Reply reply;
+    int fd = -1;
+    if (!send_message(connection.socket_fd, &request, sizeof(request), request.new_segment ? connection.input.fd : -1) ||
+        !receive_message(connection.socket_fd, &reply, sizeof(reply), fd))
+    {
+        return false;
+    }
+    if (fd >= 0)
+    {
+        shared_buffer_attach(connection.output, fd);
+    }
+
+    size_t bytes = (size_t)reply.width * reply.height * reply.channels;
+    if (!reply.success || connection.output.bytes == nullptr || bytes > connection.output.size)
+    {
+        return false;
+    }
+    result = make_buffer(reply.width, reply.height, reply.channels);
+    memcpy(result.data.data(), connection.output.bytes, bytes);
+    return true;
+}
+
+/**
+ * Description - Sends one filter request to the server for a BMP file and writes the result
+ * @param socket_path     path of the server's Unix domain socket
+ * @param filter          the menu number of the filter
+ * @param input_filename  BMP image filename
+ * @param output_filename BMP file name to save the result to
+ * @param param_1         first filter parameter
+ * @param param_2         second filter parameter
+ * @return the program exit code
+ */
+int run_client(string socket_path, int filter, string input_filename, string output_filename, double param_1, double param_2)
+{
+    Server_Connection connection;
+    Image_Buffer image;
+    Image_Buffer result;
+    bool success = connect_to_server(socket_path, connection) && read_image_fast(input_filename, image) &&
+                   server_apply(connection, image, filter, param_1, param_2, result) &&
+                   write_image_fast(output_filename, result);
+    disconnect_from_server(connection);
+
+    if (success == true)
+    {cout << "Successfully applied filter " << filter << "!" << endl;}
+    else
+    {cout << "Server request failed" << endl;}
+    return success ? 0 : 1;
+}
+
+/**
+ * Description - Load generator: several connections send requests back to back and the latency of every request
+ * is recorded. Prints latency percentiles and throughput.
+ * @param socket_path path of the server's Unix domain socket
+ * @param filter      the menu number of the filter
+ * @param requests    number of requests per connection
+ * @param connections number of concurrent connections
+ * @param width       test image width
+ * @param height      test image height
+ * @param param_1     first filter parameter
+ * @param param_2     second filter parameter
+ * @return the program exit code
+ */
+int run_load_generator(string socket_path, int filter, int requests, int connections, int width, int height, double param_1, double param_2)
+{
+    Image_Buffer image = make_test_image(width, height);
+    vector<vector<double>> latencies(connections);
+    vector<int> failures(connections, 0);
+    vector<thread> clients;
+
+    auto start = chrono::steady_clock::now();
+    for (int c = 0; c < connections; c++)
+    {
+        clients.emplace_back([&, c]()
+        {
+            Server_Connection connection;
+            if (!connect_to_server(socket_path, connection))
+            {
+                failures[c] = requests;
+                return;
+            }
+            Image_Buffer result;
+            for (int i = 0; i < requests; i++)
+            {
+                auto request_start = chrono::steady_clock::now();
+                bool success = server_apply(connection, image, filter, param_1, param_2, result);
+                auto request_end = chrono::steady_clock::now();
+                latencies[c].push_back(chrono::duration<double, milli>(request_end - request_start).count());
+                failures[c] += success ? 0 : 1;
+            }
+            disconnect_from_server(connection);
+        });
+    }
+    for (thread& client : clients)
+    {
+        client.join();
+    }
+    double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+    vector<double> all;
+    int failed = 0;
+    for (int c = 0; c < connections; c++)
+    {
+        all.insert(all.end(), latencies[c].begin(), latencies[c].end());
+        failed += failures[c];
+    }
+    if (all.empty())
+    {
+        cout << "Could not connect to " << socket_path << endl;
+        return 1;
+    }
+    sort(all.begin(), all.end());
+
+    cout << "Load: filter " << filter << ", " << width << "x" << height << ", " << connections << " connections x "
+         << requests << " requests, " << failed << " failed" << endl;
+    cout << "  latency p50 " << all[all.size() / 2] << " ms, p90 " << all[all.size() * 9 / 10] << " ms, p99 "
+         << all[all.size() * 99 / 100] << " ms, max " << all.back() << " ms" << endl;
+    cout << "  throughput " << all.size() / seconds << " requests/s, "
+         << all.size() * (double)width * height / seconds / 1e6 << " Mpixels/s" << endl;
+    return failed == 0 ? 0 : 1;
+}
+
+/**
+ * Description - Checks that images sent through serve_connection() on a socket pair, with and without alpha,
+ * come back identical to applying the filter directly
+ * @return True if every check passed and false otherwise
+ */
+bool check_server_round_trip()
+{
+    int sockets[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sockets) != 0)
+    {
+        cout << "  FAILED to create a socket pair" << endl;
+        return false;
+    }
+    thread server(serve_connection, sockets[1]);
+    Server_Connection connection;
+    connection.socket_fd = sockets[0];
+
+    Image_Buffer rgb = make_test_image(67, 41);
+    Image_Buffer rgba = make_buffer(rgb.width, rgb.height, 4);
+    for (size_t i = 0, count = (size_t)rgb.width * rgb.height; i < count; i++)
+    {
+        copy_n(&rgb.data[3 * i], 3, &rgba.data[4 * i]);
+        rgba.data[4 * i + 3] = i * 5 % 256;
+    }
+    const double REQUESTS[][3] = {{2, 0.5, 0}, {14, Flip_Transpose, 0}, {6, 2, 3}, {13, 90, 0}};
+    bool passed = true;
+    for (const Image_Buffer* image : {&rgb, &rgba})
+    {
+        for (const auto& request : REQUESTS)
+        {
+            Image_Buffer expected;
+            Image_Buffer result;
+            apply_filter(*image, request[0], request[1], request[2], expected);
+            if (!server_apply(connection, *image, request[0], request[1], request[2], result) ||
+                result.channels != expected.channels || result.width != expected.width || result.data != expected.data)
+            {
+                cout << "  FAILED filter " << request[0] << " on " << image->channels << " channels" << endl;
+                passed = false;
+            }
+        }
+    }
+
+    // A segment the client could still truncate is refused instead of mapped
+    int unsealed = memfd_create("image", MFD_CLOEXEC);
+    Server_Request request = {2, rgb.width, rgb.height, 3, 0.5, 0, 1};
+    Server_Reply reply = {1, 0, 0, 0, 0};
+    int fd = -1;
+    bool refused = unsealed >= 0 && ftruncate(unsealed, rgb.data.size()) == 0 &&
+                   send_message(connection.socket_fd, &request, sizeof(request), unsealed) &&
+                   receive_message(connection.socket_fd, &reply, sizeof(reply), fd) && !reply.success;
+    if (unsealed >= 0)
+    {
+        close(unsealed);
+    }
+    if (fd >= 0)
+    {
+        close(fd);
+    }
+
+    disconnect_from_server(connection);
+    server.join();
+    cout << "  server round trip of 3 and 4 channel images: " << (passed ? "yes" : "NO") << endl;
+    cout << "  unsealed segment refused: " << (refused ? "yes" : "NO") << endl;
+    return passed && refused;
+}
+
+#endif
+
+//
+// RESULT CACHE
+//
+
+/**
+ * Description - 64-bit xxHash (XXH64) of a block of memory
+ * @param data   the bytes to hash
+ * @param length the number of bytes
+ * @param seed   the hash seed
+ * @return the hash value
+ */
+unsigned long long xxhash64(const unsigned char* data, size_t length, unsigned long long seed)
+{
+    const unsigned long long PRIME_1 = 0x9E3779B185EBCA87ULL;
+    const unsigned long long PRIME_2 = 0xC2B2AE3D27D4EB4FULL;
+    const unsigned long long PRIME_3 = 0x165667B19E3779F9ULL;
+    const unsigned long long PRIME_4 = 0x85EBCA77C2B2AE63ULL;
+    const unsigned long long PRIME_5 = 0x27D4EB2F165667C5ULL;
+
+    auto rotate = [](unsigned long long value, int bits) { return (value << bits) | (value >> (64 - bits)); };
+    auto read_64 = [](const unsigned char* bytes) { unsigned long long value; memcpy(&value, bytes, 8); return value; };
+    auto read_32 = [](const unsigned char* bytes) { unsigned int value; memcpy(&value, bytes, 4); return (unsigned long long)value; };
+    auto round = [&](unsigned long long accumulator, unsigned long long input)
+    {
+        return rotate(accumulator + input * PRIME_2, 31) * PRIME_1;
+    };
+    auto merge = [&](unsigned long long hash, unsigned long long accumulator)
+    {
+        return (hash ^ round(0, accumulator)) * PRIME_1 + PRIME_4;
+    };
+
+    const unsigned char* end = data + length;
+    unsigned long long hash;
+    if (length >= 32)
+    {
+        unsigned long long v1 = seed + PRIME_1 + PRIME_2;
+        unsigned long long v2 = seed + PRIME_2;
+        unsigned long long v3 = seed;
+        unsigned long long v4 = seed - PRIME_1;
+        for (; data + 32 <= end; data += 32)
+        {
+            v1 = round(v1, read_64(data));
+            v2 = round(v2, read_64(data + 8));
+            v3 = round(v3, read_64(data + 16));
+            v4 = round(v4, read_64(data + 24));
+        }
+        hash = rotate(v1, 1) + rotate(v2, 7) + rotate(v3, 12) + rotate(v4, 18);
+        hash = merge(merge(merge(merge(hash, v1), v2), v3), v4);
+    }
+    else
+    {
+        hash = seed + PRIME_5;
+    }
+    hash += length;
+
+    for (; data + 8 <= end; data += 8)
+    {
+        hash = rotate(hash ^ round(0, read_64(data)), 27) * PRIME_1 + PRIME_4;
+    }
+    if (data + 4 <= end)
+    {
+        hash = rotate(hash ^ (read_32(data) * PRIME_1), 23) * PRIME_2 + PRIME_3;
+        data += 4;
+    }
+    for (; data < end; data++)
+    {
+        hash = rotate(hash ^ (*data * PRIME_5), 11) * PRIME_1;
+    }
+
+    hash ^= hash >> 33;
+    hash *= PRIME_2;
+    hash ^= hash >> 29;
+    hash *= PRIME_3;
+    hash ^= hash >> 32;
+    return hash;
+}
+
+/**
+ * Description - Zeroes the parameters a filter ignores and rounds the ones it truncates, so equivalent requests
+ * share a cache entry
+ * @param filter  the menu number of the filter
+ * @param param_1 first filter parameter
+ * @param param_2 second filter parameter
+ */
+void normalize_filter_params(int filter, double& param_1, double& param_2)
+{
+    if (filter == 2 || filter == 8 || filter == 9 || filter == 12 || filter == 13)
+    {
+        param_2 = 0;
+    }
+    else if (filter == 5)
+    {
+        param_1 = quarter_turns(param_1);
+        param_2 = 0;
+    }
+    else if (filter == 7 || filter == 10 || filter == 14 || filter == 18)
+    {
+        param_1 = (int)param_1;
+        param_2 = 0;
+    }
+    else if (filter == 19)
+    {
+        param_1 = (int)param_1;
+    }
+    else if (filter == 15)
+    {
+        param_2 = (int)param_2;
+    }
+    else if (filter == 6)
+    {
+        param_1 = (int)param_1;
+        param_2 = (int)param_2;
+    }
+    else
+    {
+        param_1 = 0;
+        param_2 = 0;
+    }
+}
+
+/**
+ * Description - Adds the hit and miss counts of one cache stats file to the totals
+ * @param path   the stats file
+ * @param hits   the hit total
+ * @param misses the miss total
+ */
+void read_cache_stats(string path, long long& hits, long long& misses)
+{
+    long long count = 0;
+    string label;
+    ifstream in(path);
+    while (in >> label >> count)
+    {
+        if (label == "hits") { hits += count; }
+        else if (label == "misses") { misses += count; }
+    }
+}
+
+/**
+ * Description - On-disk cache of filter results. Entries are BMP files named after a hash of the input file
+ * contents, the filter and its parameters. When the cache grows past its size limit the least recently used
+ * entries are removed. Each process adds its hit and miss counts to its own stats-<pid>.txt in the cache
+ * directory, so processes sharing a cache never overwrite each other's counts.
+ */
+class Result_Cache
+{
+public:
+    Result_Cache(string directory, long long max_bytes) : directory(directory), max_bytes(max_bytes)
+    {
+        filesystem::create_directories(directory);
+    }
+
+    ~Result_Cache()
+    {
+        save_stats();
+    }
+
+    /**
+     * Description - Builds the cache key for a filter request
+     * @param input   the input file contents
+     * @param filter  the menu number of the filter
+     * @param param_1 first filter parameter
+     * @param param_2 second filter parameter
+     * @return the key as 16 hex digits
+     */
+    string key(const vector<unsigned char>& input, int filter, double param_1, double param_2)
+    {
+        normalize_filter_params(filter, param_1, param_2);
+        unsigned long long request[5] = {xxhash64(input.data(), input.size(), 0), (unsigned long long)filter, 0, 0,
+                                         CACHE_FORMAT};
+        memcpy(&request[2], &param_1, 8);
+        memcpy(&request[3], &param_2, 8);
+        char hex[17];
+        snprintf(hex, sizeof(hex), "%016llx", xxhash64((const unsigned char*)request, sizeof(request), 0));
+        return hex;
+    }
+
+    /**
+     * Description - Copies a cached result to the output file if there is one
+     * @param key             the cache key
+     * @param output_filename where to put the cached result
+     * @return True on a hit and false on a miss
+     */
+    bool lookup(const string& key, string output_filename)
+    {
+        error_code error;
+        filesystem::path entry = entry_path(key);
+        if (filesystem::copy_file(entry, output_filename, filesystem::copy_options::overwrite_existing, error))
+        {
+            // The modification time doubles as the last use time for eviction
+            filesystem::last_write_time(entry, filesystem::file_time_type::clock::now(), error);
+            hits++;
+            return true;
+        }
+        misses++;
+        return false;
+    }
+
+    /**
+     * Description - Adds a result to the cache and evicts old entries if the cache is over its size limit
+     * @param key  the cache key
+     * @param file the encoded result
+     */
+    void store(const string& key, const vector<unsigned char>& file)
+    {
+        // Write under a temporary name first so readers never see a partial entry
+        error_code error;
+        filesystem::path entry = entry_path(key);
+        filesystem::path temporary = entry;
+        temporary += ".tmp" + to_string(hash<thread::id>()(this_thread::get_id()));
+        if (write_file(temporary.string(), file))
+        {
+            filesystem::rename(temporary, entry, error);
+        }
+        filesystem::remove(temporary, error);
+        evict();
+    }
+
+    long long hits = 0;
+    long long misses = 0;
+
+    // Part of every key; bump it when a filter's output or its parameters change, so old entries are never hit
+    static const unsigned long long CACHE_FORMAT = 1;
+
+private:
+    filesystem::path entry_path(const string& key) const
+    {
+        return filesystem::path(directory) / (key + ".bmp");
+    }
+
+    void evict()
+    {
+        error_code error;
+        vector<pair<filesystem::file_time_type, filesystem::path>> entries;
+        long long total_bytes = 0;
+        for (const filesystem::directory_entry& entry : filesystem::directory_iterator(directory, error))
+        {
+            if (entry.path().extension() == ".bmp")
+            {
+                entries.push_back({entry.last_write_time(error), entry.path()});
+                total_bytes += entry.file_size(error);
+            }
+        }
+        sort(entries.begin(), entries.end());
+        for (size_t i = 0; i < entries.size() && total_bytes > max_bytes; i++)
+        {
+            long long size = filesystem::file_size(entries[i].second, error);
+            if (filesystem::remove(entries[i].second, error))
+            {
+                total_bytes -= size;
+            }
+        }
+    }
+
+    void save_stats()
+    {
+        // Only this process writes this file, so reading and rewriting it cannot lose another process's counts
+        string path = (filesystem::path(directory) / ("stats-" + to_string(getpid()) + ".txt")).string();
+        long long total_hits = 0;
+        long long total_misses = 0;
+        read_cache_stats(path, total_hits, total_misses);
+        string temporary = path + ".tmp";
+        {
+            ofstream out(temporary);
+            out << "hits " << total_hits + hits << endl << "misses " << total_misses + misses << endl;
+        }
+        error_code error;
+        filesystem::rename(temporary, path, error);
+    }
+
+    string directory;
+    long long max_bytes;
+};
+
+/**
+ * Description - Applies a filter to a BMP file without any prompts. With a cache, a hit copies the stored result
+ * and skips decoding, filtering and encoding.
+ * @param filter          the menu number of the filter
+ * @param input_filename  BMP image filename
+ * @param output_filename BMP file name to save the result to
+ * @param param_1         first filter parameter
+ * @param param_2         second filter parameter
+ * @param cache           the result cache, or nullptr for none
+ * @return True if successful and false otherwise
+ */
+bool apply_filter_to_file(int filter, string input_filename, string output_filename, double param_1, double param_2, Result_Cache* cache)
+{
+    vector<unsigned char> input;
+    if (!read_file(input_filename, input))
+    {
+        return false;
+    }
+
+    string key;
+    if (cache != nullptr)
+    {
+        key = cache->key(input, filter, param_1, param_2);
+        if (cache->lookup(key, output_filename))
+        {
+            return true;
+        }
+    }
+
+    Image_Buffer image;
+    Image_Buffer result;
+    if (!decode_bmp(input, image) || !apply_filter(image, filter, param_1, param_2, result))
+    {
+        return false;
+    }
+    vector<unsigned char> output = encode_bmp(result);
+    if (cache != nullptr)
+    {
+        cache->store(key, output);
+    }
+    return write_file(output_filename, output);
+}
+
+/**
+ * Description - Prints the hit and miss totals and the size of a result cache
+ * @param directory the cache directory
+ * @return the program exit code
+ */
+int print_cache_stats(string directory)
+{
+    error_code error;
+    long long entries = 0;
+    long long total_bytes = 0;
+    long long hits = 0;
+    long long misses = 0;
+    for (const filesystem::directory_entry& entry : filesystem::directory_iterator(directory, error))
+    {
+        if (entry.path().extension() == ".bmp")
+        {
+            entries++;
+            total_bytes += entry.file_size(error);
+        }
+        // stats.txt is the shared file older versions wrote
+        else if (entry.path().extension() == ".txt" && entry.path().filename().string().rfind("stats", 0) == 0)
+        {
+            read_cache_stats(entry.path().string(), hits, misses);
+        }
+    }
+
+    cout << "Cache " << directory << ": " << entries << " entries, " << total_bytes / 1e6 << " MB" << endl;
+    cout << "  hits " << hits << ", misses " << misses;
+    if (hits + misses > 0)
+    {
+        cout << ", hit rate " << 100.0 * hits / (hits + misses) << "%";
+    }
+    cout << endl;
+    return 0;
+}
+
+//
+// BATCH SCHEDULER
+//
+
+// One image of a batch, sized from its BMP header before anything is decoded
+struct Batch_Job
+{
+    string input;
+    string output;
+    int width = 0;
+    int height = 0;
+    int bits_per_pixel = 0;
+    long long bytes = 0;    // estimated peak memory while it is processed
+    bool alone = false;     // processed by itself from the calling thread, so the filter can use all workers
+    bool tiled = false;     // processed alone and split into bands spread over all workers
+    bool success = false;
+};
+
+// Totals of a finished batch
+struct Batch_Summary
+{
+    int images = 0;
+    int failed = 0;
+    int alone = 0;
+    int tiled = 0;
+    double megapixels = 0;
+    double elapsed_ms = 0;
+    long long peak_bytes = 0;
+};
+
+// Images with at least this many pixels are processed one at a time on all workers instead of getting a thread of
+// their own
+const long long LARGE_IMAGE_PIXELS = 1 << 22;
+
+// Rows per band when a large image is split
+const int BATCH_BAND_ROWS = 256;
+
+/**
+ * Description - Reads the size and bit depth of a BMP file from its header, without reading the pixels
+ * @param filename BMP image filename
+ * @param job      the job to fill in
+ * @return True if the header describes an image decode_bmp() can read and false otherwise
+ */
+bool read_bmp_header(string filename, Batch_Job& job)
+{
+    const int HEADER_SIZE = 54;
+    unsigned char header[HEADER_SIZE];
+    ifstream stream(filename, ios::binary);
+    if (!stream.read((char*)header, HEADER_SIZE) || header[0] != 'B' || header[1] != 'M')
+    {
+        return false;
+    }
+    job.width = (int)get_int_from_bytes(&header[18], 4);
+    job.height = abs((int)get_int_from_bytes(&header[22], 4));
+    job.bits_per_pixel = get_int_from_bytes(&header[28], 2);
+    return job.width > 0 && job.height > 0 && (job.bits_per_pixel == 24 || job.bits_per_pixel == 32)
+        && (long long)job.width * job.height <= decode_limits.max_pixels;
+}
+
+/**
+ * Description - Whether every output pixel of a filter depends only on the same input pixel, so an image can be
+ * filtered in independent bands. The quantizers only are without dithering: error diffusion crosses band edges
+ * and the ordered matrix is positioned by the row.
+ * @param filter  the menu number of the filter
+ * @param param_1 first filter parameter (the dither mode of filters 7 and 10)
+ * @return True for the per-pixel filters
+ */
+bool filter_is_per_pixel(int filter, double param_1)
+{
+    bool quantizer = filter == 7 || filter == 10;
+    return filter == 0 || filter == 2 || filter == 3 || filter == 8 || filter == 9 || filter == 12 || filter == 13 ||
+           (quantizer && param_1 >= No_Dither && param_1 < No_Dither + 1);
+}
+
+/**
+ * Description - Estimates the peak memory of processing rows of an image: the file, the input and output buffers,
+ * for filters 1-10 the two vectors of Pixels, and the column histograms each thread of the median filter keeps
+ * @param job     the job
+ * @param filter  the menu number of the filter
+ * @param param_1 first filter parameter
+ * @param param_2 second filter parameter
+ * @param rows    number of rows filtered at once per thread
+ * @param threads number of threads filtering at once
+ * @return the estimate in bytes
+ */
+long long estimate_job_bytes(const Batch_Job& job, int filter, double param_1, double param_2, long long rows, int threads)
+{
+    long long channels = job.bits_per_pixel / 8;
+    long long pixels = (long long)job.width * job.height;
+    long long filtered = (long long)job.width * rows * threads;
+    double growth = filter == 6 ? max(1.0, param_1) * max(1.0, param_2) : filter == 15 ? 2 : 1;
+    long long bytes = pixels * channels * 2 + (long long)(pixels * channels * growth);
+    if (filter >= 1 && filter <= 10)
+    {
+        bytes += (long long)(filtered * sizeof(Pixel) * (1 + growth));
+    }
+    if (filter == 18)
+    {
+        // 256 fine and 16 coarse 16-bit bins per column and color channel, on every worker when it runs alone
+        int histogram_threads = job.alone ? worker_count() : threads;
+        bytes += (long long)job.width * 3 * (256 + 16) * sizeof(unsigned short) * histogram_threads;
+    }
+    return bytes;
+}
+
+/**
+ * Description - Hands out a fixed number of bytes to the jobs running at once
+ */
+class Memory_Budget
+{
+public:
+    explicit Memory_Budget(long long limit) : limit(limit) {}
+
+    /**
+     * Description - Waits until the bytes fit in the budget. A job bigger than the whole budget runs once
+     * nothing else is running.
+     * @param bytes number of bytes to take
+     */
+    void reserve(long long bytes)
+    {
+        unique_lock<mutex> lock(budget_lock);
+        freed.wait(lock, [&]() { return used == 0 || used + bytes <= limit; });
+        used += bytes;
+        peak = max(peak, used);
+    }
+
+    /**
+     * Description - Gives bytes back to the budget
+     * @param bytes number of bytes taken by reserve()
+     */
+    void release(long long bytes)
+    {
+        lock_guard<mutex> lock(budget_lock);
+        used -= bytes;
+        freed.notify_all();
+    }
+
+    long long peak_bytes() const { return peak; }
+
+private:
+    mutex budget_lock;
+    condition_variable freed;
+    long long limit;
+    long long used = 0;
+    long long peak = 0;
+};
+
+/**
+ * Description - Decodes, filters and writes one image on the calling thread
+ * @return True if successful and false otherwise
+ */
+bool run_batch_job(const Batch_Job& job, int filter, double param_1, double param_2)
+{
+    Image_Buffer image;
+    Image_Buffer result;
+    return read_image_fast(job.input, image) && apply_filter(image, filter, param_1, param_2, result)
+        && write_image_fast(job.output, result);
+}
+
+/**
+ * Description - Decodes a large image, filters it in bands of BATCH_BAND_ROWS rows spread over the worker
+ * threads and writes it. Only valid for per-pixel filters, where the bands give the same result as the whole
+ * image. Each worker filters one band at a time, which also bounds the memory of the vector of Pixels filters.
+ * @return True if successful and false otherwise
+ */
+bool run_tiled_batch_job(const Batch_Job& job, int filter, double param_1, double param_2)
+{
+    Image_Buffer image;
+    if (!read_image_fast(job.input, image))
+    {
+        return false;
+    }
+    Image_Buffer result = make_buffer(image.width, image.height, image.channels);
+    int bands = (image.height + BATCH_BAND_ROWS - 1) / BATCH_BAND_ROWS;
+    atomic<bool> success(true);
+
+    parallel_rows(bands, [&](int first_band, int end_band)
+    {
+        for (int band = first_band; band < end_band; band++)
+        {
+            int first_row = band * BATCH_BAND_ROWS;
+            int rows = min(BATCH_BAND_ROWS, image.height - first_row);
+            Image_Buffer part = make_buffer(image.width, rows, image.channels);
+            copy_n(image.row(first_row), part.data.size(), part.data.data());
+            Image_Buffer filtered;
+            if (!apply_filter(part, filter, param_1, param_2, filtered) || filtered.data.size() != part.data.size())
+            {
+                success = false;
+                continue;
+            }
+            copy_n(filtered.data.data(), filtered.data.size(), result.row(first_row));
+        }
+    });
+    return success && write_image_fast(job.output, result);
+}
+
+/**
+ * Description - Applies a filter to every BMP image in a directory. All headers are read first to size the jobs.
+ * Large images run one at a time from the calling thread: with a per-pixel filter they are split into bands
+ * across all workers, otherwise the filter's own row split uses all workers (filters 12-15, 18 and 19; the vector
+ * of Pixels filters 1 and 4-6 have none). The rest are packed onto the workers one image per thread, biggest
+ * first. Every running job holds its estimated memory
+ * from a shared budget, so many small images run at once but a few big ones never oversubscribe memory.
+ * @param input_directory  directory of BMP images
+ * @param output_directory directory for the results, created if needed
+ * @param filter           the menu number of the filter
+ * @param param_1          first filter parameter
+ * @param param_2          second filter parameter
+ * @param budget_bytes     memory budget in bytes
+ * @param verbose          print a line per failed image
+ * @return the batch totals
+ */
+Batch_Summary run_batch(string input_directory, string output_directory, int filter, double param_1, double param_2,
+                        long long budget_bytes, bool verbose)
+{
+    auto start = chrono::steady_clock::now();
+    Batch_Summary summary;
+    vector<Batch_Job> jobs;
+    error_code error;
+    filesystem::create_directories(output_directory, error);
+
+    for (const auto& entry : filesystem::directory_iterator(input_directory, error))
+    {
+        string extension = entry.path().extension().string();
+        transform(extension.begin(), extension.end(), extension.begin(), ::tolower);
+        if (!entry.is_regular_file() || extension != ".bmp")
+        {
+            continue;
+        }
+        Batch_Job job;
+        job.input = entry.path().string();
+        job.output = (filesystem::path(output_directory) / entry.path().filename()).string();
+        jobs.push_back(job);
+    }
+
+    int threads = worker_count();
+    vector<Batch_Job*> large_jobs;
+    vector<Batch_Job*> packed_jobs;
+    for (Batch_Job& job : jobs)
+    {
+        if (!read_bmp_header(job.input, job))
+        {
+            continue;
+        }
+        long long pixels = (long long)job.width * job.height;
+        job.bytes = estimate_job_bytes(job, filter, param_1, param_2, job.height, 1);
+        // Packed onto a pool worker, parallel_rows() runs inline, so a large image would get a single core
+        job.alone = threads > 1 && (pixels >= LARGE_IMAGE_PIXELS || job.bytes * threads > budget_bytes);
+        job.tiled = job.alone && filter_is_per_pixel(filter, param_1);
+        if (job.tiled)
+        {
+            job.bytes = estimate_job_bytes(job, filter, param_1, param_2, min(job.height, BATCH_BAND_ROWS), threads);
+        }
+        else if (job.alone)
+        {
+            job.bytes = estimate_job_bytes(job, filter, param_1, param_2, job.height, 1);
+        }
+        if (job.alone)
+        {
+            large_jobs.push_back(&job);
+        }
+        else
+        {
+            packed_jobs.push_back(&job);
+        }
+    }
+    sort(packed_jobs.begin(), packed_jobs.end(), [](const Batch_Job* a, const Batch_Job* b) { return a->bytes > b->bytes; });
+
+    Memory_Budget budget(budget_bytes);
+    for (Batch_Job* job : large_jobs)
+    {
+        budget.reserve(job->bytes);
+        job->success = job->tiled ? run_tiled_batch_job(*job, filter, param_1, param_2) : run_batch_job(*job, filter, param_1, param_2);
+        budget.release(job->bytes);
+    }
+
+    atomic<size_t> next_job(0);
+    auto pack = [&](int)
+    {
+        for (size_t i = next_job++; i < packed_jobs.size(); i = next_job++)
+        {
+            Batch_Job& job = *packed_jobs[i];
+            budget.reserve(job.bytes);
+            job.success = run_batch_job(job, filter, param_1, param_2);
+            budget.release(job.bytes);
+        }
+    };
+    if (threads > 1)
+    {
+        worker_pool().run(min<size_t>(threads, max<size_t>(packed_jobs.size(), 1)), pack);
+    }
+    else
+    {
+        pack(0);
+    }
+
+    for (const Batch_Job& job : jobs)
+    {
+        summary.images++;
+        summary.alone += job.alone;
+        summary.tiled += job.tiled;
+        if (job.success)
+        {
+            summary.megapixels += (double)job.width * job.height / 1e6;
+        }
+        else
+        {
+            summary.failed++;
+            if (verbose)
+            {
+                cout << "  failed: " << job.input << endl;
+            }
+        }
+    }
+    summary.peak_bytes = budget.peak_bytes();
+    summary.elapsed_ms = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+    return summary;
+}
+
+/**
+ * Description - Prints the totals of a batch
+ * @param summary the batch totals
+ */
+void print_batch_summary(const Batch_Summary& summary)
 {
-    string output_filename = "";
-    vector<vector<Pixel>> image;
-    vector<vector<Pixel>> new_image;
-    double scaling_factor = 1;
+    cout << summary.images - summary.failed << " of " << summary.images << " images processed ("
+         << summary.alone << " large, run alone on all workers, " << summary.tiled << " of those split into bands) in " << summary.elapsed_ms << " ms, "
+         << summary.megapixels / summary.elapsed_ms * 1000 << " Mpixels/s, peak reserved memory "
+         << summary.peak_bytes / (1 << 20) << " MB" << endl;
+}
+
+/**
+ * Description - Benchmarks the batch scheduler against one image per thread in directory order, on a generated
+ * directory of 200 small images and 2 large ones
+ * @param filter the menu number of the filter to apply
+ */
+void benchmark_batch(int filter)
+{
+    string unique = to_string(chrono::steady_clock::now().time_since_epoch().count());
+    filesystem::path directory = filesystem::temp_directory_path() / ("image_batch_bench_" + unique);
+    filesystem::create_directories(directory / "in");
+    for (int i = 0; i < 200; i++)
+    {
+        write_image_fast((directory / "in" / ("small_" + to_string(i) + ".bmp")).string(), make_test_image(64 + i % 5 * 48, 64 + i % 7 * 32));
+    }
+    for (int i = 0; i < 2; i++)
+    {
+        write_image_fast((directory / "in" / ("large_" + to_string(i) + ".bmp")).string(), make_test_image(4096, 2048));
+    }
+    cout << "Batch benchmark, filter " << filter << ", 200 small and 2 large (4096x2048) images, " << worker_count() << " threads" << endl;
+
+    // One image per thread in directory order, no sizing
+    vector<filesystem::path> files;
+    for (const auto& entry : filesystem::directory_iterator(directory / "in"))
+    {
+        files.push_back(entry.path());
+    }
+    filesystem::create_directories(directory / "naive");
+    double naive_ms = time_ms([&]()
+    {
+        atomic<size_t> next_file(0);
+        auto work = [&](int)
+        {
+            for (size_t i = next_file++; i < files.size(); i = next_file++)
+            {
+                Batch_Job job;
+                job.input = files[i].string();
+                job.output = (directory / "naive" / files[i].filename()).string();
+                run_batch_job(job, filter, 1.2, 0);
+            }
+        };
+        if (worker_count() > 1)
+        {
+            worker_pool().run(worker_count(), work);
+        }
+        else
+        {
+            work(0);
+        }
+    }, 1);
+    cout << "  one image per thread: " << naive_ms << " ms" << endl;
+
+    cout << "  scheduler: ";
+    print_batch_summary(run_batch((directory / "in").string(), (directory / "out").string(), filter, 1.2, 0, 1LL << 30, true));
+    filesystem::remove_all(directory);
+}
+
+//
+// DECODER CORPUS AND FUZZING
+//
+// The fuzz target is built with clang and libFuzzer instead of main():
+//   clang++ -std=c++17 -g -O1 -fsanitize=fuzzer,address -DIMAGE_FUZZER Lindsey_main.cpp -o bmp_fuzzer
+//   ./bmp_fuzzer fuzz_corpus
+//
+
+/**
+ * Description - Builds a mix of valid and malformed BMP files for decoder tests and benchmarks
+ * @param size the width of the valid images (the height is about 3/4 of it)
+ * @return the files as (name, contents) pairs
+ */
+vector<pair<string, vector<unsigned char>>> make_decoder_corpus(int size)
+{
+    vector<pair<string, vector<unsigned char>>> corpus;
+
+    // Odd width so the rows need padding
+    vector<unsigned char> valid = encode_bmp(make_test_image(size + 1, size * 3 / 4 + 1));
+    corpus.push_back({"valid_24", valid});
+
+    vector<unsigned char> top_down = valid;
+    set_bytes(top_down.data(), 22, 4, -(int)get_int_from_bytes(&valid[22], 4));
+    corpus.push_back({"valid_top_down", top_down});
+
+    // 32-bit copy of the same image, alpha set to opaque
+    int width = get_int_from_bytes(&valid[18], 4);
+    int height = get_int_from_bytes(&valid[22], 4);
+    int scanline_size = (width * 3 + 3) / 4 * 4;
+    vector<unsigned char> valid_32(54 + (size_t)width * height * 4);
+    copy(valid.begin(), valid.begin() + 54, valid_32.begin());
+    set_bytes(valid_32.data(), 2, 4, valid_32.size());
+    set_bytes(valid_32.data(), 28, 2, 32);
+    set_bytes(valid_32.data(), 34, 4, width * height * 4);
+    for (int row = 0; row < height; row++)
+    {
+        for (int col = 0; col < width; col++)
+        {
+            unsigned char* out = &valid_32[54 + ((size_t)row * width + col) * 4];
+            copy_n(&valid[54 + (size_t)row * scanline_size + col * 3], 3, out);
+            out[3] = 255;
+        }
+    }
+    corpus.push_back({"valid_32", valid_32});
+
+    // The same pixels as a V4 BI_BITFIELDS file with the bytes in red, green, blue, alpha order
+    Image_Buffer with_alpha;
+    decode_bmp(valid_32, with_alpha);
+    vector<unsigned char> rgba_masks = encode_bmp_32(with_alpha);
+    for (size_t i = 122; i + 3 < rgba_masks.size(); i += 4)
+    {
+        swap(rgba_masks[i], rgba_masks[i + 2]);
+    }
+    set_bytes(rgba_masks.data(), 54, 4, 0x000000FF);
+    set_bytes(rgba_masks.data(), 62, 4, 0x00FF0000);
+    corpus.push_back({"valid_32_rgba_masks", rgba_masks});
+
+    // Masks that are not whole bytes, and pixel data starting inside the V4 header
+    vector<unsigned char> bad_masks = encode_bmp_32(with_alpha);
+    set_bytes(bad_masks.data(), 54, 4, 0x0000FFF0);
+    corpus.push_back({"bad_masks", bad_masks});
+    vector<unsigned char> offset_in_dib_header = encode_bmp_32(with_alpha);
+    set_bytes(offset_in_dib_header.data(), 10, 4, 54);
+    corpus.push_back({"offset_in_dib_header", offset_in_dib_header});
+
+    // A 1x1 BI_BITFIELDS file whose 41 byte DIB header ends before the masks would
+    vector<unsigned char> odd_dib_header(valid_32.begin(), valid_32.begin() + 59);
+    set_bytes(odd_dib_header.data(), 2, 4, odd_dib_header.size());
+    set_bytes(odd_dib_header.data(), 10, 4, 55);
+    set_bytes(odd_dib_header.data(), 14, 4, 41);
+    set_bytes(odd_dib_header.data(), 18, 4, 1);
+    set_bytes(odd_dib_header.data(), 22, 4, 1);
+    set_bytes(odd_dib_header.data(), 30, 4, 3);
+    set_bytes(odd_dib_header.data(), 34, 4, 4);
+    corpus.push_back({"odd_dib_header", odd_dib_header});
+
+    // Each malformed file changes one header field of the valid file (offset, bytes, value)
+    const struct { const char* name; int offset; int bytes; int value; } BROKEN_FIELDS[] =
+    {
+        {"bad_magic", 0, 1, 'X'},
+        {"huge_dimensions_width", 18, 4, 0x7fffffff},
+        {"huge_dimensions_height", 22, 4, 0x7fffffff},
+        {"negative_width", 18, 4, -5},
+        {"zero_height", 22, 4, 0},
+        {"bad_bits_per_pixel", 28, 2, 8},
+        {"zero_bits_per_pixel", 28, 2, 0},
+        {"offset_past_end", 10, 4, 0x7ffffff0},
+        {"offset_in_header", 10, 4, 10},
+        {"compressed", 30, 4, 1},
+        {"bad_planes", 26, 2, 3},
+        {"short_dib_header", 14, 4, 12}
+    };
+    for (const auto& field : BROKEN_FIELDS)
+    {
+        vector<unsigned char> broken = valid;
+        set_bytes(broken.data(), field.offset, field.bytes, field.value);
+        corpus.push_back({field.name, broken});
+    }
+
+    // 65536 x 65536 x 4 bytes does not fit in 32 bits
+    vector<unsigned char> overflow = valid;
+    set_bytes(overflow.data(), 18, 4, 65536);
+    set_bytes(overflow.data(), 22, 4, 65536);
+    corpus.push_back({"overflow_dimensions", overflow});
+
+    corpus.push_back({"truncated_header", vector<unsigned char>(valid.begin(), valid.begin() + 30)});
+    corpus.push_back({"truncated_pixels", vector<unsigned char>(valid.begin(), valid.begin() + valid.size() / 2)});
+    corpus.push_back({"empty", vector<unsigned char>()});
+    return corpus;
+}
+
+/**
+ * Description - Writes the decoder corpus with small images, used as the fuzzing seed corpus
+ * @param directory the directory to write to
+ * @return the program exit code
+ */
+int write_decoder_corpus(string directory)
+{
+    filesystem::create_directories(directory);
     bool success = true;
+    for (const auto& entry : make_decoder_corpus(7))
+    {
+        success = write_file((filesystem::path(directory) / (entry.first + ".bmp")).string(), entry.second) && success;
+    }
+    return success ? 0 : 1;
+}
 
-    cout << "Grayscale selected" << endl;
-    cout << "Enter output BMP filename: ";
-    cin >> output_filename;
-    
-    image = read_image(input_filename);
-    new_image = process_3(image);
-    success = write_image(output_filename, new_image);
-    
-    if (success == true)
-    {cout << "Successfully applied GrayScale!" << endl;}
-    else
-    {cout << "Process 3 failed" << endl;}
+/**
+ * Description - Benchmarks the checked decoder over a mixed corpus of valid and malformed files, in memory and
+ * from disk, and compares reading the valid files with read_image()
+ * @param size the width of the valid images
+ */
+void benchmark_decode(int size)
+{
+    vector<pair<string, vector<unsigned char>>> corpus = make_decoder_corpus(size);
+    vector<const vector<unsigned char>*> valid;
+    vector<const vector<unsigned char>*> malformed;
+    long long total_bytes = 0;
+    long long valid_bytes_in_memory = 0;
+    for (const auto& entry : corpus)
+    {
+        Image_Buffer image;
+        total_bytes += entry.second.size();
+        if (decode_bmp(entry.second, image))
+        {
+            valid.push_back(&entry.second);
+            valid_bytes_in_memory += entry.second.size();
+        }
+        else
+        {
+            malformed.push_back(&entry.second);
+        }
+    }
+    cout << "Decode benchmark: " << corpus.size() << " files (" << valid.size() << " valid), "
+         << total_bytes / 1e6 << " MB" << endl;
+
+    double valid_ms = time_ms([&]()
+    {
+        Image_Buffer image;
+        for (const vector<unsigned char>* file : valid)
+        {
+            decode_bmp(*file, image);
+        }
+    }, 5);
+    double malformed_ms = time_ms([&]()
+    {
+        Image_Buffer image;
+        for (const vector<unsigned char>* file : malformed)
+        {
+            decode_bmp(*file, image);
+        }
+    }, 5);
+    cout << "  checked decode in memory: valid files " << valid_bytes_in_memory / 1e3 / valid_ms << " MB/s, "
+         << "malformed files rejected in " << malformed_ms * 1e3 / max<size_t>(1, malformed.size()) << " us each" << endl;
+
+    // Only the valid files go through read_image(), which trusts the header
+    filesystem::path directory = filesystem::temp_directory_path() / "bmp_decode_benchmark";
+    filesystem::create_directories(directory);
+    vector<string> valid_files;
+    long long valid_bytes = 0;
+    for (const auto& entry : corpus)
+    {
+        Image_Buffer image;
+        if (decode_bmp(entry.second, image) && entry.first != "valid_top_down")
+        {
+            valid_files.push_back((directory / (entry.first + ".bmp")).string());
+            write_file(valid_files.back(), entry.second);
+            valid_bytes += entry.second.size();
+        }
+    }
+    double fast_ms = time_ms([&]()
+    {
+        Image_Buffer image;
+        for (const string& filename : valid_files)
+        {
+            read_image_fast(filename, image);
+        }
+    }, 3);
+    double legacy_ms = time_ms([&]()
+    {
+        for (const string& filename : valid_files)
+        {
+            read_image(filename);
+        }
+    }, 1);
+    cout << "  valid files from disk: read_image_fast " << valid_bytes / 1e3 / fast_ms << " MB/s, read_image "
+         << valid_bytes / 1e3 / legacy_ms << " MB/s" << endl;
+
+    error_code error;
+    filesystem::remove_all(directory, error);
 }
 
+#ifdef IMAGE_FUZZER
 /**
- * Status == working, needs clean up
- * Description - Rotates image by 90 degrees clockwise (not counter-clockwise)
- * @param filename BMP image filename
- * @return the image as a vector of vector of Pixels
+ * Description - libFuzzer entry point: decodes the input with small limits and re-encodes anything accepted
  */
-vector<vector<Pixel>> process_4(const vector<vector<Pixel>>& image)
-{    
-    int num_rows = image.size();
-    int num_cols = image[0].size();
+extern "C" int LLVMFuzzerTestOneInput(const unsigned char* data, size_t size)
+{
+    Decode_Limits limits;
+    limits.max_pixels = 1 << 22;
+    limits.max_bytes = 1 << 24;
+    Image_Buffer image;
+    if (decode_bmp(data, size, image, limits))
+    {
+        encode_bmp(image);
+    }
+    return 0;
+}
+#endif
 
-    // Invert the rows and cols for new_new_image and the nested for loops
-    vector<vector<Pixel>> new_new_image(num_cols, vector<Pixel> (num_rows));
+//
+// IMAGE FORMATS
+//
+// Every format reads and writes one image at a time through a FILE*, so the same code handles files and
+// stdin/stdout, and a stream of several images (concatenated PPMs or raw frames) is processed image by image.
+//
 
-    for (int col = 0; col < num_cols; col++)
+// Width and height of headerless raw input, set with --raw-size
+struct Raw_Format
+{
+    int width = 0;
+    int height = 0;
+};
+Raw_Format raw_format;
+
+/**
+ * Description - Reads exactly size bytes
+ * @param in    the input stream
+ * @param bytes where to store them
+ * @param size  the number of bytes
+ * @return True if all bytes were read and false otherwise
+ */
+bool read_bytes(FILE* in, unsigned char* bytes, size_t size)
+{
+    return fread(bytes, 1, size, in) == size;
+}
+
+/**
+ * Description - Checks image dimensions against the decode limits before anything is allocated
+ * @param width  width in pixels
+ * @param height height in pixels
+ * @return True if an image of this size may be decoded
+ */
+bool dimensions_allowed(long long width, long long height)
+{
+    return width > 0 && height > 0 && width * height <= decode_limits.max_pixels &&
+           width * height * 3 <= decode_limits.max_bytes;
+}
+
+/**
+ * Description - Reads one BMP image from a stream. Only the header and the pixel rows it describes are read,
+ * then the bytes go through the checked decoder.
+ */
+bool read_bmp_stream(FILE* in, Image_Buffer& image)
+{
+    vector<unsigned char> file(54);
+    if (!read_bytes(in, file.data(), file.size()))
     {
-        for (int row = 0; row < num_rows; row++)
-        {    
-            int red_color = image[row][col].red;
-            int green_color = image[row][col].green;
-            int blue_color = image[row][col].blue;
+        return false;
+    }
+    long long start = get_int_from_bytes(&file[10], 4);
+    long long width = (int)get_int_from_bytes(&file[18], 4);
+    long long height = abs((int)get_int_from_bytes(&file[22], 4));
+    long long bits_per_pixel = get_int_from_bytes(&file[28], 2);
+    if (!dimensions_allowed(width, height) || start < 54 || (bits_per_pixel != 24 && bits_per_pixel != 32))
+    {
+        return false;
+    }
+    long long length = start + (width * bits_per_pixel / 8 + 3) / 4 * 4 * height;
+    if (length > decode_limits.max_bytes)
+    {
+        return false;
+    }
+    file.resize(length);
+    return read_bytes(in, file.data() + 54, length - 54) && decode_bmp(file, image);
+}
 
-            new_new_image[col][(num_rows - 1) - row].red   = red_color;
-            new_new_image[col][(num_rows - 1) - row].green = green_color;
-            new_new_image[col][(num_rows - 1) - row].blue  = blue_color;
+/**
+ * Description - Writes one BMP image to a stream: 32-bit with a BITMAPV4HEADER when the buffer has an alpha
+ * channel, 24-bit otherwise
+ */
+bool write_bmp_stream(FILE* out, const Image_Buffer& image)
+{
+    vector<unsigned char> file = encode_bmp(image);
+    return fwrite(file.data(), 1, file.size(), out) == file.size();
+}
+
+/**
+ * Description - Reads a whitespace separated number from a netpbm header, skipping # comments
+ * @param in     the input stream
+ * @param number the number read
+ * @return True if successful and false otherwise
+ */
+bool read_netpbm_number(FILE* in, long long& number)
+{
+    int c = fgetc(in);
+    while (c == '#' || isspace(c))
+    {
+        if (c == '#')
+        {
+            while (c != '\n' && c != EOF)
+            {
+                c = fgetc(in);
+            }
         }
+        c = fgetc(in);
     }
-    return new_new_image;
+    number = 0;
+    int digits = 0;
+    while (isdigit(c) && digits < 10)
+    {
+        number = number * 10 + (c - '0');
+        digits++;
+        c = fgetc(in);
+    }
+    // Exactly one whitespace character follows the last header number
+    return digits > 0 && isspace(c);
 }
 
 /**
- * Description - Process 4 Wrapper function. Takes input filename, calls read_image functions to transform the image into a vector,
- * calls process_4 function to apply Rotate 90 Degrees, calls write_image fucntion to transform the new vector into a .bmp file, and prints success,
- * if the image transformation was successful.
- * @param input_filename BMP image filename
+ * Description - Reads a binary netpbm header (P5 or P6) and checks the size against the decode limits. Only one
+ * byte samples are supported, so the maximum value must be at most 255.
+ * @param in        the input stream
+ * @param kind      the expected magic digit, '5' or '6'
+ * @param width     the width read
+ * @param height    the height read
+ * @param max_value the sample value that means full intensity
+ * @return True if successful and false otherwise
  */
-void process_4_wrapper(string input_filename)
+bool read_netpbm_header(FILE* in, char kind, long long& width, long long& height, long long& max_value)
 {
-    string output_filename = "";
-    vector<vector<Pixel>> image;
-    vector<vector<Pixel>> new_image;
-    double scaling_factor = 1;
-    bool success = true;
+    return fgetc(in) == 'P' && fgetc(in) == kind && read_netpbm_number(in, width) && read_netpbm_number(in, height) &&
+           read_netpbm_number(in, max_value) && max_value > 0 && max_value <= 255 && dimensions_allowed(width, height);
+}
 
-    cout << "Rotate 90 degrees selected" << endl;
-    cout << "Enter output BMP filename: ";
-    cin >> output_filename;
-    
-    image = read_image(input_filename);
-    new_image = process_4(image); 
-    success = write_image(output_filename, new_image);
-    
-    if (success == true)
-    {cout << "Successfully applied 90 degree rotation!" << endl;}
-    else
-    {cout << "Process 4 failed" << endl;}   
+/**
+ * Description - Rescales netpbm samples from 0-max_value to 0-255 in place; samples above max_value become 255
+ * @param bytes     the samples
+ * @param count     the number of samples
+ * @param max_value the maximum value from the header
+ */
+void rescale_netpbm_samples(unsigned char* bytes, size_t count, long long max_value)
+{
+    if (max_value == 255)
+    {
+        return;
+    }
+    unsigned char table[256];
+    for (int value = 0; value < 256; value++)
+    {
+        table[value] = value >= max_value ? 255 : (value * 255 + max_value / 2) / max_value;
+    }
+    for (size_t i = 0; i < count; i++)
+    {
+        bytes[i] = table[bytes[i]];
+    }
+}
+
+/**
+ * Description - Reads one binary PPM (P6) image; the pixel data is read straight into the image buffer
+ */
+bool read_ppm_stream(FILE* in, Image_Buffer& image)
+{
+    long long width = 0;
+    long long height = 0;
+    long long max_value = 0;
+    if (!read_netpbm_header(in, '6', width, height, max_value))
+    {
+        return false;
+    }
+    image = make_buffer(width, height);
+    if (!read_bytes(in, image.data.data(), image.data.size()))
+    {
+        return false;
+    }
+    rescale_netpbm_samples(image.data.data(), image.data.size(), max_value);
+    return true;
+}
+
+/**
+ * Description - Writes one binary PPM (P6) image
+ */
+bool write_ppm_stream(FILE* out, const Image_Buffer& image)
+{
+    Image_Buffer rgb = without_alpha(image);
+    fprintf(out, "P6\n%d %d\n255\n", rgb.width, rgb.height);
+    return fwrite(rgb.data.data(), 1, rgb.data.size(), out) == rgb.data.size();
+}
+
+/**
+ * Description - Reads one binary PGM (P5) image, copying the gray value into all three channels
+ */
+bool read_pgm_stream(FILE* in, Image_Buffer& image)
+{
+    long long width = 0;
+    long long height = 0;
+    long long max_value = 0;
+    if (!read_netpbm_header(in, '5', width, height, max_value))
+    {
+        return false;
+    }
+    image = make_buffer(width, height);
+    vector<unsigned char> grays(width);
+    for (int row = 0; row < image.height; row++)
+    {
+        if (!read_bytes(in, grays.data(), grays.size()))
+        {
+            return false;
+        }
+        rescale_netpbm_samples(grays.data(), grays.size(), max_value);
+        unsigned char* out = image.row(row);
+        for (int col = 0; col < image.width; col++)
+        {
+            out[3 * col] = out[3 * col + 1] = out[3 * col + 2] = grays[col];
+        }
+    }
+    return true;
+}
+
+/**
+ * Description - Writes one binary PGM (P5) image using BT.601 luma, the usual netpbm gray conversion
+ */
+bool write_pgm_stream(FILE* out, const Image_Buffer& image)
+{
+    fprintf(out, "P5\n%d %d\n255\n", image.width, image.height);
+    vector<unsigned char> grays(image.width);
+    for (int row = 0; row < image.height; row++)
+    {
+        rgb_to_luma_row(image.row(row), image.channels, grays.data(), image.width, Luma_BT601);
+        if (fwrite(grays.data(), 1, grays.size(), out) != grays.size())
+        {
+            return false;
+        }
+    }
+    return true;
 }
 
 /**
- * IN WORK
- * Description - Rotates image by a specified number of multiples of 90 degrees clockwise
- * @param filename BMP image filename
- * @return the image as a vector of vector of Pixels
+ * Description - Reads one headerless frame of interleaved red, green, blue bytes of size --raw-size
  */
-vector<vector<Pixel>> process_5(const vector<vector<Pixel>>& image, int number)
+bool read_raw_rgb_stream(FILE* in, Image_Buffer& image)
 {
-    int angle = number * 90;
-    //cout << "the angle is: " << angle << endl;;
-    
-    if (angle % 360 == 0)
-        { return image; }
-    else if (angle % 360 == 90)
-        { return process_4(image); }
-    else if (angle % 360 == 180)
-        { return process_4(process_4(image)); }
-    else
-        { return process_4(process_4(process_4(image))); }
+    if (!dimensions_allowed(raw_format.width, raw_format.height))
+    {
+        return false;
+    }
+    image = make_buffer(raw_format.width, raw_format.height);
+    return read_bytes(in, image.data.data(), image.data.size());
 }
 
 /**
- * Description - Process 5 Wrapper function. Takes input filename, calls read_image functions to transform the image into a vector,
- * calls process_5 function to apply Multiple 90 degree rotation, calls write_image fucntion to transform the new vector into a .bmp file, and prints success,
- * if the image transformation was successful.
- * @param input_filename BMP image filename
+ * Description - Writes one headerless frame of interleaved red, green, blue bytes
  */
-void process_5_wrapper(string input_filename)
+bool write_raw_rgb_stream(FILE* out, const Image_Buffer& image)
 {
-    string output_filename = "";
-    vector<vector<Pixel>> image;
-    vector<vector<Pixel>> new_image;
-    double scaling_factor = 1;
-    bool success = true;
-    int num_90_degree_rotations = 0;
-
-    cout << "Process multiple 90 degrees selected" << endl;
-    
-    cout << "Enter output BMP filename: ";
-    cin >> output_filename;
-    cout << "Enter number of 90 degree rotations: ";
-    cin >> num_90_degree_rotations;
-    
-    image = read_image(input_filename); 
-    new_image = process_5(image, num_90_degree_rotations); 
-    success = write_image(output_filename, new_image);
-    
-    if (success == true)
-    {cout << "Successfully applied multiple 90 degree rotations!" << endl;}
-    else
-    {cout << "Process 5 failed" << endl;}
+    Image_Buffer rgb = without_alpha(image);
+    return fwrite(rgb.data.data(), 1, rgb.data.size(), out) == rgb.data.size();
 }
 
 /**
- * IN WORK
- * Description - Enlarges the image in the x and y direction
- * @param filename BMP image filename
- * @return the image as a vector of vector of Pixels
+ * Description - Reads one headerless planar frame (all red bytes, then all green, then all blue) of size --raw-size
  */
-vector<vector<Pixel>> process_6(const vector<vector<Pixel>>& image, int x_scale, int y_scale)
-{   
-    int num_rows = image.size(); 
-    int num_cols = image[0].size(); 
-
-    vector<vector<Pixel>> new_new_image(num_rows * y_scale, vector<Pixel> (num_cols * x_scale));
-
-    for (int row = 0; row < num_rows * y_scale; row++)
+bool read_raw_planar_stream(FILE* in, Image_Buffer& image)
+{
+    if (!dimensions_allowed(raw_format.width, raw_format.height))
     {
-        for (int col = 0; col < num_cols * x_scale; col++)
-        {         
-            int red_color = image[row/y_scale][col / x_scale].red;
-            int green_color = image[row/y_scale][col / x_scale].green;
-            int blue_color = image[row/y_scale][col / x_scale].blue;
-
-            new_new_image[row][col].red   = red_color;
-            new_new_image[row][col].green = green_color;
-            new_new_image[row][col].blue  = blue_color;
+        return false;
+    }
+    size_t count = (size_t)raw_format.width * raw_format.height;
+    vector<unsigned char> planes(count * 3);
+    if (!read_bytes(in, planes.data(), planes.size()))
+    {
+        return false;
+    }
+    image = make_buffer(raw_format.width, raw_format.height);
+    for (int c = 0; c < 3; c++)
+    {
+        const unsigned char* plane = planes.data() + c * count;
+        unsigned char* out = image.data.data() + c;
+        for (size_t i = 0; i < count; i++)
+        {
+            out[3 * i] = plane[i];
         }
     }
-    return new_new_image;
+    return true;
 }
 
 /**
- * Description - Process 6 Wrapper function. Takes input filename, calls read_image functions to transform the image into a vector,
- * calls process_6 function to apply Enlarge, calls write_image fucntion to transform the new vector into a .bmp file, and prints success,
- * if the image transformation was successful.
- * @param input_filename BMP image filename
+ * Description - Writes one headerless planar frame
  */
-void process_6_wrapper(string input_filename)
+bool write_raw_planar_stream(FILE* out, const Image_Buffer& image)
 {
-    string output_filename = "";
-    vector<vector<Pixel>> image;
-    vector<vector<Pixel>> new_image;
-    double scaling_factor = 1;
-    bool success = true;
-    int x_scale = 1; 
-    int y_scale = 1; 
-
-    cout << "Enlarge selected" << endl;
-    cout << "Enter output BMP filename: ";
-    cin >> output_filename;
-    cout << "Enter X scale: ";
-    cin >> x_scale;
-    cout << "Enter Y scale: ";
-    cin >> y_scale;
-    
-    image = read_image(input_filename); 
-    new_image = process_6(image, x_scale, y_scale);
-    success = write_image(output_filename, new_image);
-    
-    if (success == true){cout << "Successfully enlarged!" << endl;}
-    else{cout << "Process 7 failed" << endl;}  
+    size_t count = (size_t)image.width * image.height;
+    vector<unsigned char> plane(count);
+    for (int c = 0; c < 3; c++)
+    {
+        const unsigned char* in = image.data.data() + c;
+        for (size_t i = 0; i < count; i++)
+        {
+            plane[i] = in[image.channels * i];
+        }
+        if (fwrite(plane.data(), 1, count, out) != count)
+        {
+            return false;
+        }
+    }
+    return true;
 }
 
-/**
- * IN WORK
- * Description - Convert image to high contrast (black and white only)
- * @param filename BMP image filename
- * @return the image as a vector of vector of Pixels
- */
-vector<vector<Pixel>> process_7(const vector<vector<Pixel>>& image)
-{ 
-    int num_rows = image.size(); 
-    int num_cols = image[0].size(); 
+// One entry of the codec registry
+struct Image_Codec
+{
+    string name;
+    string extension;
+    bool (*read)(FILE* in, Image_Buffer& image);
+    bool (*write)(FILE* out, const Image_Buffer& image);
+};
 
-    vector<vector<Pixel>> new_new_image(num_rows, vector<Pixel> (num_cols));
+// The codec registry
+const Image_Codec IMAGE_CODECS[] =
+{
+    {"bmp",    ".bmp",    read_bmp_stream,        write_bmp_stream},
+    {"ppm",    ".ppm",    read_ppm_stream,        write_ppm_stream},
+    {"pgm",    ".pgm",    read_pgm_stream,        write_pgm_stream},
+    {"rgb",    ".rgb",    read_raw_rgb_stream,    write_raw_rgb_stream},
+    {"planar", ".planar", read_raw_planar_stream, write_raw_planar_stream}
+};
 
-    for (int row = 0; row < num_rows; row++)
+/**
+ * Description - Finds the codec for a file: by name if one is given, otherwise by the file extension.
+ * stdin/stdout ("-") default to BMP.
+ * @param filename the file name, or "-"
+ * @param name     the codec name, or "" to use the extension
+ * @return the codec, or nullptr if there is none
+ */
+const Image_Codec* find_codec(string filename, string name)
+{
+    if (name == "")
     {
-        for (int col = 0; col < num_cols; col++)
-        {         
-            int red_color = image[row][col].red;
-            int green_color = image[row][col].green;
-            int blue_color = image[row][col].blue;
-
-            double gray_value = (red_color + green_color + blue_color) / 3;
-
-            if (gray_value >= 255/2)
-            {
-                new_new_image[row][col].red   = 255;
-                new_new_image[row][col].green = 255;
-                new_new_image[row][col].blue  = 255;
-            }
-            else
-            {
-                new_new_image[row][col].red   = 0;
-                new_new_image[row][col].green = 0;
-                new_new_image[row][col].blue  = 0;
-            }
+        name = "bmp";
+        size_t dot = filename.rfind('.');
+        if (filename != "-" && dot != string::npos)
+        {
+            name = filename.substr(dot + 1);
+            transform(name.begin(), name.end(), name.begin(), ::tolower);
         }
     }
-    return new_new_image;
+    for (const Image_Codec& codec : IMAGE_CODECS)
+    {
+        if (codec.name == name)
+        {
+            return &codec;
+        }
+    }
+    return nullptr;
 }
 
 /**
- * Description - Process 7 Wrapper function. Takes input filename, calls read_image functions to transform the image into a vector,
- * calls process_7 function to apply High Contrast, calls write_image fucntion to transform the new vector into a .bmp file, and prints success,
- * if the image transformation was successful.
- * @param input_filename BMP image filename
+ * Description - Applies a filter to every image in an input stream and writes each result as soon as it is done.
+ * "-" reads stdin or writes stdout, so the program can sit in a pipe without temporary files.
+ * @param filter          the menu number of the filter
+ * @param input_filename  the input file or "-"
+ * @param output_filename the output file or "-"
+ * @param input_codec     the input format
+ * @param output_codec    the output format
+ * @param param_1         first filter parameter
+ * @param param_2         second filter parameter
+ * @return the number of images processed, or -1 on an error
  */
-void process_7_wrapper(string input_filename)
+int apply_filter_to_stream(int filter, string input_filename, string output_filename, const Image_Codec& input_codec,
+                           const Image_Codec& output_codec, double param_1, double param_2)
 {
-    string output_filename = "";
-    vector<vector<Pixel>> image;
-    vector<vector<Pixel>> new_image;
-    double scaling_factor = 1;
-    bool success = true;
-    int x_scale = 1; 
-    int y_scale = 1; 
+#ifdef _WIN32
+    _setmode(_fileno(stdin), _O_BINARY);
+    _setmode(_fileno(stdout), _O_BINARY);
+#endif
+    FILE* in = input_filename == "-" ? stdin : fopen(input_filename.c_str(), "rb");
+    FILE* out = output_filename == "-" ? stdout : fopen(output_filename.c_str(), "wb");
+    int images = in != nullptr && out != nullptr ? 0 : -1;
 
-    cout << "High Contrast selected" << endl << "Enter output BMP filename: ";
-    cin >> output_filename;
-    
-    image = read_image(input_filename); 
-    new_image = process_7(image);
-    success = write_image(output_filename, new_image);
-    
-    if (success == true){cout << "Successfully applied high contrast!" << endl;}
-    else{cout << "Process 7 failed" << endl;}
+    Image_Buffer image;
+    Image_Buffer result;
+    while (images >= 0)
+    {
+        // A clean end of input between images ends the stream
+        int next = fgetc(in);
+        if (next == EOF)
+        {
+            break;
+        }
+        ungetc(next, in);
+
+        if (!input_codec.read(in, image) || !apply_filter(image, filter, param_1, param_2, result) ||
+            !output_codec.write(out, result))
+        {
+            images = -1;
+            break;
+        }
+        fflush(out);
+        images++;
+    }
+
+    if (in != nullptr && in != stdin)
+    {
+        fclose(in);
+    }
+    if (out != nullptr && out != stdout && fclose(out) != 0)
+    {
+        images = -1;
+    }
+    return images;
 }
 
+//
+// REGRESSION TESTS
+//
+// --selftest runs every filter over a set of generated images and compares a hash of each result with the
+// golden hashes in regression/golden_hashes.txt. When a hash differs, a filter with a tolerance still passes if
+// no channel value is further than the tolerance from its stored reference image in regression/reference/. It
+// then times every filter and fails if the throughput dropped by more than the allowed fraction below
+// regression/perf_baseline.txt.
+//
+
+// One filter configuration checked by the regression tests
+struct Regression_Case
+{
+    string name;
+    int tolerance;      // allowed difference of any channel value from the reference image when the hash differs
+    function<Image_Buffer(const Image_Buffer&)> run;
+};
+
 /**
- * IN WORK
- * Description - Lightens image by a scaling factor
- * @param filename BMP image filename
- * @return the image as a vector of vector of Pixels
+ * Description - The filter configurations checked by the regression tests
+ * @return the cases
  */
-vector<vector<Pixel>> process_8(const vector<vector<Pixel>>& image, double scaling_factor)
-{    
-    int num_rows = image.size();
-    int num_cols = image[0].size(); 
+vector<Regression_Case> regression_cases()
+{
+    // Runs a menu filter through apply_filter()
+    auto filter = [](int number, double param_1, double param_2)
+    {
+        return [=](const Image_Buffer& image)
+        {
+            Image_Buffer result;
+            apply_filter(image, number, param_1, param_2, result);
+            return result;
+        };
+    };
 
-    vector<vector<Pixel>> new_new_image(num_rows, vector<Pixel> (num_cols));
+    // Composites a 40x30 test overlay at (10, 5) with 80% opacity, optionally onto the image with alpha added
+    auto composite_onto = [](bool with_alpha, int mode)
+    {
+        return [=](const Image_Buffer& image)
+        {
+            Image_Buffer result = image;
+            if (with_alpha)
+            {
+                result = make_buffer(image.width, image.height, 4);
+                for (size_t i = 0, count = (size_t)image.width * image.height; i < count; i++)
+                {
+                    copy_n(&image.data[3 * i], 3, &result.data[4 * i]);
+                    result.data[4 * i + 3] = i * 7 % 256;
+                }
+            }
+            composite(result, make_test_overlay(40, 30), 10, 5, mode, 0.8);
+            return result;
+        };
+    };
 
-    for (int row = 0; row < num_rows; row++)
+    return
     {
-        for (int col = 0; col < num_cols; col++)
-        {          
-            int red_color = image[row][col].red;
-            int green_color = image[row][col].green;
-            int blue_color = image[row][col].blue;
+        // The vignette uses floating point sqrt and pow, which may round differently with other compilers
+        {"vignette", 2, filter(1, 0, 0)},
+        {"clarendon_0.3", 0, filter(2, 0.3, 0)},
+        {"clarendon_1.7", 0, filter(2, 1.7, 0)},
+        {"grayscale", 0, filter(3, 0, 0)},
+        {"grayscale_bt601", 0, [](const Image_Buffer& image) { return pixels_to_buffer(process_3(buffer_to_pixels(image), Luma_BT601)); }},
+        {"grayscale_bt709", 0, [](const Image_Buffer& image) { return pixels_to_buffer(process_3(buffer_to_pixels(image), Luma_BT709)); }},
+        {"rotate_90", 0, filter(4, 0, 0)},
+        {"rotate_270", 0, filter(5, 3, 0)},
+        {"enlarge_2x3", 0, filter(6, 2, 3)},
+        {"high_contrast", 0, filter(7, 0, 0)},
+        {"high_contrast_floyd_steinberg", 0, [](const Image_Buffer& image) { return quantize_high_contrast(image, Floyd_Steinberg); }},
+        {"high_contrast_ordered", 0, [](const Image_Buffer& image) { return quantize_high_contrast(image, Ordered_Bayer); }},
+        {"lighten_0.5", 0, filter(8, 0.5, 0)},
+        {"darken_0.5", 0, filter(9, 0.5, 0)},
+        {"five_color", 0, filter(10, 0, 0)},
+        {"five_color_floyd_steinberg", 0, [](const Image_Buffer& image) { return quantize_five_colors(image, Floyd_Steinberg); }},
+        {"five_color_ordered", 0, [](const Image_Buffer& image) { return quantize_five_colors(image, Ordered_Bayer); }},
+        {"pyramid_level_2", 0, [](const Image_Buffer& image) { return downscale_2x(downscale_2x(image)); }},
+        {"saturation_1.5", 0, filter(12, 1.5, 0)},
+        {"hue_shift_90", 0, filter(13, 90, 0)},
+        {"flip_horizontal", 0, filter(14, Flip_Horizontal, 0)},
+        {"flip_vertical", 0, filter(14, Flip_Vertical, 0)},
+        {"transpose", 0, filter(14, Flip_Transpose, 0)},
+        {"rotate_7_nearest", 0, filter(15, 7, Nearest_Sampling)},
+        {"rotate_7_bilinear", 0, filter(15, 7, Bilinear_Sampling)},
+        {"rotate_-33_bilinear", 0, filter(15, -33, Bilinear_Sampling)},
+        {"composite_over", 0, composite_onto(false, Blend_Over)},
+        {"composite_multiply", 0, composite_onto(false, Blend_Multiply)},
+        {"composite_screen", 0, composite_onto(false, Blend_Screen)},
+        {"composite_overlay", 0, composite_onto(false, Blend_Overlay)},
+        {"composite_over_rgba", 0, composite_onto(true, Blend_Over)},
+        {"composite_overlay_rgba", 0, composite_onto(true, Blend_Overlay)},
+        {"median_1", 0, filter(18, 1, 0)},
+        {"median_4", 0, filter(18, 4, 0)},
+        // The bilateral weights come from float exp(), which may round differently with other compilers
+        {"bilateral_3_30", 2, filter(19, 3, 30)},
+        {"tone_chain", 0, [](const Image_Buffer& image)
+        {
+            Image_Buffer result;
+            apply_tone_chain(image, {{9, 0.6}, {8, 0.6}, {2, 1.3}}, result);
+            return result;
+        }}
+    };
+}
 
-            int color_sum = red_color + green_color + blue_color;
+/**
+ * Description - The generated images the regression tests run on
+ * @return the images as (name, image) pairs
+ */
+vector<pair<string, Image_Buffer>> regression_images()
+{
+    vector<pair<string, Image_Buffer>> images;
+    images.push_back({"noise_64x48", make_test_image(64, 48)});
+    images.push_back({"noise_127x33", make_test_image(127, 33)});
 
-            new_new_image[row][col].red   = (255 - (255 - red_color)   * scaling_factor);
-            new_new_image[row][col].green = (255 - (255 - green_color) * scaling_factor);
-            new_new_image[row][col].blue  = (255 - (255 - blue_color)  * scaling_factor);        
-        }
+    // Pure and mixed colors at the quantizer thresholds, plus black and white
+    Image_Buffer swatches = make_buffer(16, 16);
+    for (int i = 0; i < 256; i++)
+    {
+        swatches.data[3 * i]     = (i & 1 ? 255 : 0) ^ (i & 16 ? 127 : 0);
+        swatches.data[3 * i + 1] = (i & 2 ? 255 : 0) ^ (i & 32 ? 128 : 0);
+        swatches.data[3 * i + 2] = (i & 4 ? 255 : 0) ^ (i & 64 ? 170 : 0) ^ (i & 8 ? 90 : 0);
     }
-    return new_new_image;
+    images.push_back({"swatches_16x16", swatches});
+    return images;
 }
 
 /**
- * Description - Process 8 Wrapper function. Takes input filename, calls read_image functions to transform the image into a vector,
- * calls process_8 function to apply Lighten, calls write_image fucntion to transform the new vector into a .bmp file, and prints success,
- * if the image transformation was successful.
- * @param input_filename BMP image filename
+ * Description - Hash of an image's size and pixels
+ * @param image the image
+ * @return the hash as 16 hex digits
  */
-void process_8_wrapper(string input_filename)
+string image_hash(const Image_Buffer& image)
 {
-    string output_filename = "";
-    vector<vector<Pixel>> image;
-    vector<vector<Pixel>> new_image;
-    double scaling_factor = 1;
-    bool success = true;
-    int x_scale = 1; 
-    int y_scale = 1; 
+    char hex[17];
+    unsigned long long seed = (unsigned long long)image.width << 32 | (unsigned int)image.height;
+    snprintf(hex, sizeof(hex), "%016llx", xxhash64(image.data.data(), image.data.size(), seed));
+    return hex;
+}
 
-    cout << "Lighten selected" << endl << "Enter output BMP filename: ";
-    cin >> output_filename;
-    cout << "Enter scaling factor: ";
-    cin >> scaling_factor;
-    
-    image = read_image(input_filename); 
-    new_image = process_8(image, scaling_factor);
-    success = write_image(output_filename, new_image);
-    
-    if (success == true)
-    {cout << "Successfully lightened!" << endl;}
-    else
-    {cout << "Process 8 failed" << endl;}   
+/**
+ * Description - Mean of all channel values of an image
+ * @param image the image
+ * @return the mean value
+ */
+double image_mean(const Image_Buffer& image)
+{
+    long long sum = 0;
+    for (unsigned char value : image.data)
+    {
+        sum += value;
+    }
+    return image.data.empty() ? 0 : (double)sum / image.data.size();
 }
 
 /**
- * IN WORK
- * Description - Darkens image by a scaling factor
- * @param filename BMP image filename
- * @return the image as a vector of vector of Pixels
+ * Description - Largest difference of any channel value between two images
+ * @param image     the image
+ * @param reference the reference image
+ * @return the difference, or 256 if the sizes or channel counts differ
  */
-vector<vector<Pixel>> process_9(const vector<vector<Pixel>>& image, double scaling_factor)
-{    
-    int num_rows = image.size(); 
-    int num_cols = image[0].size(); 
+int largest_difference(const Image_Buffer& image, const Image_Buffer& reference)
+{
+    if (image.width != reference.width || image.height != reference.height || image.channels != reference.channels)
+    {
+        return 256;
+    }
+    int largest = 0;
+    for (size_t i = 0; i < image.data.size(); i++)
+    {
+        largest = max(largest, abs(image.data[i] - reference.data[i]));
+    }
+    return largest;
+}
 
-    vector<vector<Pixel>> new_new_image(num_rows, vector<Pixel> (num_cols));
+/**
+ * Description - Checks every regression case against the golden hashes, or rewrites them. Cases with a tolerance
+ * also keep their results as reference images next to the golden file.
+ * @param golden_filename the golden hash file
+ * @param update          True to write the current results as the new golden hashes and reference images
+ * @return True if every case passed and false otherwise
+ */
+bool check_golden_images(string golden_filename, bool update)
+{
+    // Golden entries: "case/image hash mean" per line
+    map<string, pair<string, double>> golden;
+    ifstream in(golden_filename);
+    string key;
+    string hash;
+    double mean;
+    while (in >> key >> hash >> mean)
+    {
+        golden[key] = {hash, mean};
+    }
+    if (golden.empty() && !update)
+    {
+        cout << "  no golden hashes in " << golden_filename << endl;
+        return false;
+    }
 
-    for (int row = 0; row < num_rows; row++)
+    bool passed = true;
+    ostringstream updated;
+    vector<pair<string, Image_Buffer>> images = regression_images();
+    for (const Regression_Case& test : regression_cases())
     {
-        for (int col = 0; col < num_cols; col++)
-        {          
-            int red_color = image[row][col].red;
-            int green_color = image[row][col].green;
-            int blue_color = image[row][col].blue;
-            int color_sum = red_color + green_color + blue_color;
+        for (const auto& image : images)
+        {
+            Image_Buffer result = test.run(image.second);
+            key = test.name + "/" + image.first;
+            hash = image_hash(result);
+            mean = image_mean(result);
+            updated << key << " " << hash << " " << fixed << setprecision(4) << mean << "\n";
+            filesystem::path reference_filename = filesystem::path(golden_filename).parent_path() / "reference" / (key + ".bmp");
+            if (update)
+            {
+                if (test.tolerance > 0)
+                {
+                    filesystem::create_directories(reference_filename.parent_path());
+                    write_image_fast(reference_filename.string(), result);
+                }
+                continue;
+            }
 
-            new_new_image[row][col].red   = red_color   * scaling_factor;
-            new_new_image[row][col].green = green_color * scaling_factor;
-            new_new_image[row][col].blue  = blue_color  * scaling_factor;    
+            auto expected = golden.find(key);
+            bool matched = expected != golden.end() && expected->second.first == hash;
+            Image_Buffer reference;
+            int difference = !matched && test.tolerance > 0 && read_image_fast(reference_filename.string(), reference) ?
+                             largest_difference(result, reference) : -1;
+            if (!matched && (difference < 0 || difference > test.tolerance))
+            {
+                passed = false;
+                cout << "  FAIL " << key << ": hash " << hash << ", mean " << mean;
+                if (expected != golden.end())
+                {
+                    cout << " (expected " << expected->second.first << ", mean " << expected->second.second << ")";
+                }
+                if (difference >= 0)
+                {
+                    cout << ", off from the reference image by up to " << difference;
+                }
+                cout << endl;
+            }
         }
     }
-    return new_new_image;
+
+    if (update)
+    {
+        ofstream out(golden_filename);
+        out << updated.str();
+        cout << "  wrote golden hashes to " << golden_filename << endl;
+        return (bool)out;
+    }
+    cout << "  " << regression_cases().size() * images.size() << " golden image checks " << (passed ? "passed" : "FAILED") << endl;
+    return passed;
 }
 
 /**
- * Description - Process 9 Wrapper function. Takes input filename, calls read_image functions to transform the image into a vector,
- * calls process_9 function to apply Darken, calls write_image fucntion to transform the new vector into a .bmp file, and prints success,
- * if the image transformation was successful.
- * @param input_filename BMP image filename
+ * Description - Times every regression case and compares the throughput with the stored baseline, or rewrites it
+ * @param baseline_filename the baseline file
+ * @param threshold         the largest allowed slowdown as a fraction of the baseline (0.25 = 25% slower)
+ * @param update            True to write the current throughput as the new baseline
+ * @return True if no case regressed past the threshold and false otherwise
  */
-void process_9_wrapper(string input_filename)
+bool check_performance(string baseline_filename, double threshold, bool update)
 {
-    string output_filename = "";
-    vector<vector<Pixel>> image;
-    vector<vector<Pixel>> new_image;
-    double scaling_factor = 1;
-    bool success = true;
-    int x_scale = 1; 
-    int y_scale = 1; 
+    // Baseline entries: "case megapixels_per_second" per line
+    map<string, double> baseline;
+    ifstream in(baseline_filename);
+    string name;
+    double rate;
+    while (in >> name >> rate)
+    {
+        baseline[name] = rate;
+    }
 
-    cout << "Darken selected" << endl << "Enter output BMP filename: ";
-    cin >> output_filename;
-    cout << "Enter scaling factor: ";
-    cin >> scaling_factor;
-    
-    image = read_image(input_filename); 
-    new_image = process_9(image, scaling_factor);
-    success = write_image(output_filename, new_image);
-    
-    if (success == true)
-    {cout << "Successfully darkened!" << endl;}
-    else
-    {cout << "Process 9 failed" << endl;} 
+    bool passed = true;
+    ostringstream updated;
+    Image_Buffer image = make_test_image(1024, 768);
+    double megapixels = (double)image.width * image.height / 1e6;
+    for (const Regression_Case& test : regression_cases())
+    {
+        rate = megapixels / time_ms([&]() { test.run(image); }, 3) * 1000;
+        updated << test.name << " " << fixed << setprecision(2) << rate << "\n";
+        if (update || baseline.count(test.name) == 0)
+        {
+            continue;
+        }
+        double minimum = baseline[test.name] * (1 - threshold);
+        if (rate < minimum)
+        {
+            passed = false;
+            cout << "  SLOW " << test.name << ": " << rate << " Mpixels/s, baseline " << baseline[test.name]
+                 << ", minimum " << minimum << endl;
+        }
+    }
+
+    if (update)
+    {
+        ofstream out(baseline_filename);
+        out << updated.str();
+        cout << "  wrote performance baseline to " << baseline_filename << endl;
+        return (bool)out;
+    }
+    if (baseline.empty())
+    {
+        cout << "  no performance baseline in " << baseline_filename << ", skipped" << endl;
+        return true;
+    }
+    cout << "  performance within " << threshold * 100 << "% of baseline: " << (passed ? "yes" : "NO") << endl;
+    return passed;
 }
 
 /**
- * IN WORK
- * Description - Converts image to only black, white, red, blue, and green
- * @param filename BMP image filename
- * @return the image as a vector of vector of Pixels
+ * Description - Runs a non-interactive command given on the command line.
+ *   --bench pyramid [input.bmp] [levels]
+ *   --bench dither [input.bmp]
+ *   --bench rotate [input.bmp]
+ *   --bench incremental [input.bmp]
+ *   --bench blend [input.bmp]
+ *   --bench decode [width]
+ *   --bench batch [filter]
+ *   --bench denoise
+ *   --bench numa [width] [height]
+ *   --composite <image.bmp> <overlay.bmp> <output.bmp> [x] [y] [mode] [opacity]
+ *   --profile [input.bmp]   (IMAGE_PROFILE builds: hardware counters per filter and codec stage)
+ *   --batch <input dir> <output dir> <filter> [param_1] [param_2] [--memory-budget <MB>]
+ *   --write-corpus <dir>
+ *   --selftest [--golden <file>] [--baseline <file>] [--perf-threshold <fraction>] [--no-perf]
+ *              [--update-golden] [--update-baseline]
+ *   --serve <socket>
+ *   --client <socket> <filter> <input.bmp> <output.bmp> [param_1] [param_2]
+ *   --loadgen <socket> [filter] [requests] [connections] [width] [height] [param_1] [param_2]
+ *   --apply <filter> <input> <output> [param_1] [param_2] [--cache <dir>] [--cache-size <MB>]
+ *           [--in-format <name>] [--out-format <name>] [--raw-size <width>x<height>]
+ *   --cache-stats <dir>
+ * Any command also takes --max-pixels <count> and --max-bytes <count> to change the decode limits, and
+ * --placement <default|thp|hugetlb|first-touch|interleave> to choose where large buffers are allocated.
+ * @param args the command line arguments after the program name
+ * @return the program exit code
  */
-vector<vector<Pixel>> process_10(const vector<vector<Pixel>>& image)
-{    
-    int num_rows = image.size(); 
-    int num_cols = image[0].size(); 
-
-    vector<vector<Pixel>> new_new_image(num_rows, vector<Pixel> (num_cols));
+int run_command_line(vector<string> args)
+{
+    // Removes "name value" from args and returns the value, or fallback when the option was not given
+    auto take_option = [&](string name, string fallback)
+    {
+        for (size_t i = 0; i + 1 < args.size(); i++)
+        {
+            if (args[i] == name)
+            {
+                string value = args[i + 1];
+                args.erase(args.begin() + i, args.begin() + i + 2);
+                return value;
+            }
+        }
+        return fallback;
+    };
+    string cache_directory = take_option("--cache", "");
+    long long batch_megabytes = stoll(take_option("--memory-budget", "1024"));
+    long long cache_megabytes = stoll(take_option("--cache-size", "256"));
+    decode_limits.max_pixels = stoll(take_option("--max-pixels", to_string(decode_limits.max_pixels)));
+    decode_limits.max_bytes = stoll(take_option("--max-bytes", to_string(decode_limits.max_bytes)));
+    string placement = take_option("--placement", PLACEMENT_NAMES[Placement_Default]);
+    for (int policy = 0; policy < PLACEMENT_COUNT; policy++)
+    {
+        if (placement == PLACEMENT_NAMES[policy])
+        {
+            buffer_placement = (Placement_Policy)policy;
+        }
+    }
+    pin_workers = buffer_placement == Placement_First_Touch;
+    string input_format = take_option("--in-format", "");
+    string output_format = take_option("--out-format", "");
+    string raw_size = take_option("--raw-size", "0x0");
+    raw_format.width = atoi(raw_size.c_str());
+    raw_format.height = raw_size.find('x') != string::npos ? atoi(raw_size.c_str() + raw_size.find('x') + 1) : 0;
 
-    for (int row = 0; row < num_rows; row++)
+    // Removes a flag from args and returns whether it was there
+    auto take_flag = [&](string name)
     {
-        for (int col = 0; col < num_cols; col++)
-        {          
-            int red_color = image[row][col].red;
-            int green_color = image[row][col].green;
-            int blue_color = image[row][col].blue;
+        auto found = find(args.begin(), args.end(), name);
+        if (found == args.end())
+        {
+            return false;
+        }
+        args.erase(found);
+        return true;
+    };
+    string golden_filename = take_option("--golden", "regression/golden_hashes.txt");
+    string baseline_filename = take_option("--baseline", "regression/perf_baseline.txt");
+    double perf_threshold = stod(take_option("--perf-threshold", "0.5"));
+    bool update_golden = take_flag("--update-golden");
+    bool update_baseline = take_flag("--update-baseline");
+    bool skip_performance = take_flag("--no-perf");
 
-            int color_sum = red_color + green_color + blue_color;
+    // Returns args[index] as a number, or fallback when it was not given
+    auto number_arg = [&](size_t index, double fallback) { return index < args.size() ? stod(args[index]) : fallback; };
 
-            if (color_sum >= 550)
-            {
-                new_new_image[row][col].red   = 255;
-                new_new_image[row][col].green = 255;
-                new_new_image[row][col].blue  = 255;
-            }
-            else if (color_sum <= 150)
-            {
-                new_new_image[row][col].red   = 0;
-                new_new_image[row][col].green = 0;
-                new_new_image[row][col].blue  = 0;
-            }
-            else if (red_color > green_color && red_color > blue_color)
-            {
-                new_new_image[row][col].red   = 255;
-                new_new_image[row][col].green = 0;
-                new_new_image[row][col].blue  = 0;
-            }
-            else if (green_color > red_color && green_color > blue_color)
-            {
-                new_new_image[row][col].red   = 0;
-                new_new_image[row][col].green = 255;
-                new_new_image[row][col].blue  = 0;
-            }
+    if (args.size() >= 2 && args[0] == "--bench" && args[1] == "denoise")
+    {
+        benchmark_denoise();
+        return 0;
+    }
+    else if (args.size() >= 2 && args[0] == "--bench" && args[1] == "batch")
+    {
+        benchmark_batch(number_arg(2, 2));
+        return 0;
+    }
+    else if (args.size() >= 2 && args[0] == "--bench" && args[1] == "decode")
+    {
+        benchmark_decode(number_arg(2, 1024));
+        return 0;
+    }
+    else if (args.size() >= 2 && args[0] == "--bench" && args[1] == "numa")
+    {
+        benchmark_placement(number_arg(2, 8192), number_arg(3, 8192));
+        return 0;
+    }
+    else if (args.size() >= 2 && args[0] == "--bench")
+    {
+        Image_Buffer image = make_test_image(4096, 4096);
+        if (args.size() >= 3 && !read_image_fast(args[2], image))
+        {
+            cout << "Could not read " << args[2] << endl;
+            return 1;
+        }
+        if (args[1] == "pyramid")
+        {
+            benchmark_pyramid(image, number_arg(3, 5));
+            return 0;
+        }
+        if (args[1] == "dither")
+        {
+            benchmark_dither(image);
+            return 0;
+        }
+        if (args[1] == "rotate")
+        {
+            benchmark_rotate(image);
+            return 0;
+        }
+        if (args[1] == "incremental")
+        {
+            benchmark_incremental(image);
+            return 0;
+        }
+        if (args[1] == "blend")
+        {
+            benchmark_blend(image);
+            return 0;
+        }
+        if (args[1] == "tone")
+        {
+            benchmark_tone_chain(image);
+            return 0;
+        }
+    }
+    else if (args.size() >= 1 && args[0] == "--selftest")
+    {
+        cout << "Color conversions" << endl;
+        bool passed = check_color_conversions();
+        cout << "Incremental filters" << endl;
+        passed = check_incremental_filters() && passed;
+        cout << "Tone chains" << endl;
+        passed = check_tone_chains() && passed;
+        cout << "Denoising" << endl;
+        passed = check_denoise_alpha() && passed;
+#ifdef __linux__
+        cout << "Processing server" << endl;
+        passed = check_server_round_trip() && passed;
+#endif
+        cout << "Golden images" << endl;
+        passed = check_golden_images(golden_filename, update_golden) && passed;
+        if (!skip_performance)
+        {
+            cout << "Performance" << endl;
+            passed = check_performance(baseline_filename, perf_threshold, update_baseline) && passed;
+        }
+        cout << (passed ? "All checks passed" : "CHECKS FAILED") << endl;
+        return passed ? 0 : 1;
+    }
+    else if (args.size() >= 4 && args[0] == "--apply")
+    {
+        // Anything other than BMP file to BMP file goes through the codec registry
+        const Image_Codec* input_codec = find_codec(args[2], input_format);
+        const Image_Codec* output_codec = find_codec(args[3], output_format);
+        if (input_codec == nullptr || output_codec == nullptr)
+        {
+            cerr << "Unknown image format" << endl;
+            return 1;
+        }
+        if (args[2] == "-" || args[3] == "-" || input_codec->name != "bmp" || output_codec->name != "bmp")
+        {
+            int images = apply_filter_to_stream(stoi(args[1]), args[2], args[3], *input_codec, *output_codec, number_arg(4, 1), number_arg(5, 1));
+            // Status goes to stderr so it never mixes with image data on stdout
+            if (images >= 0)
+            {cerr << "Successfully applied filter " << args[1] << " to " << images << " image(s)!" << endl;}
             else
-            {
-                new_new_image[row][col].red   = 0;
-                new_new_image[row][col].green = 0;
-                new_new_image[row][col].blue  = 255;
-            }           
+            {cerr << "Filter " << args[1] << " failed" << endl;}
+            return images >= 0 ? 0 : 1;
+        }
+
+        unique_ptr<Result_Cache> cache;
+        if (cache_directory != "")
+        {
+            cache.reset(new Result_Cache(cache_directory, cache_megabytes * 1000000));
+        }
+        bool success = apply_filter_to_file(stoi(args[1]), args[2], args[3], number_arg(4, 1), number_arg(5, 1), cache.get());
+        if (cache)
+        {
+            cout << "Cache " << (cache->hits > 0 ? "hit" : "miss") << endl;
         }
+        if (success == true)
+        {cout << "Successfully applied filter " << args[1] << "!" << endl;}
+        else
+        {cout << "Filter " << args[1] << " failed" << endl;}
+        return success ? 0 : 1;
     }
-    return new_new_image;
-}
+    else if (args.size() >= 4 && args[0] == "--composite")
+    {
+        Image_Buffer image;
+        Image_Buffer overlay;
+        if (!read_image_fast(args[1], image) || !read_image_fast(args[2], overlay))
+        {
+            cout << "Could not read " << args[1] << " or " << args[2] << endl;
+            return 1;
+        }
+        composite(image, overlay, number_arg(4, 0), number_arg(5, 0), number_arg(6, Blend_Over), number_arg(7, 1));
+        return write_image_fast(args[3], image) ? 0 : 1;
+    }
+    else if (args.size() >= 5 && args[0] == "--chain")
+    {
+        Image_Buffer image;
+        Image_Buffer result;
+        vector<Tone_Step> steps;
+        for (size_t i = 3; i + 1 < args.size(); i += 2)
+        {
+            steps.push_back({stoi(args[i]), stod(args[i + 1])});
+        }
+        if (!read_image_fast(args[1], image))
+        {
+            cout << "Could not read " << args[1] << endl;
+            return 1;
+        }
+        bool success = apply_tone_chain(image, steps, result) && write_image_fast(args[2], result);
+        if (success == true)
+        {cout << "Successfully applied " << steps.size() << " tone steps!" << endl;}
+        else
+        {cout << "Tone chain failed" << endl;}
+        return success ? 0 : 1;
+    }
+    else if (args.size() >= 1 && args[0] == "--profile")
+    {
+#ifdef IMAGE_PROFILE
+        Image_Buffer image = make_test_image(2048, 1536);
+        if (args.size() >= 2 && !read_image_fast(args[1], image))
+        {
+            cout << "Could not read " << args[1] << endl;
+            return 1;
+        }
+        string filename = (filesystem::temp_directory_path() / "image_profile.bmp").string();
+        for (int i = 0; i < 3; i++)
+        {
+            write_image_fast(filename, image);
+            read_image_fast(filename, image);
+        }
+        filesystem::remove(filename);
 
-/**
- * Description - Process 10 Wrapper function. Takes input filename, calls read_image functions to transform the image into a vector,
- * calls process_10 function to apply Black, White, Red, Green, Blue, calls write_image fucntion to transform the new vector into a .bmp file, and prints success,
- * if the image transformation was successful.
- * @param input_filename BMP image filename
- */
-void process_10_wrapper(string input_filename)
-{
-    string output_filename = "";
-    vector<vector<Pixel>> image;
-    vector<vector<Pixel>> new_image;
-    double scaling_factor = 1;
-    bool success = true;
-    int x_scale = 1; 
-    int y_scale = 1; 
+        // Every filter once with typical parameters; the Pixel conversions show up as their own stages
+        const double PARAMS[][2] = {{0, 0}, {0, 0}, {1.2, 0}, {0, 0}, {0, 0}, {1, 0}, {2, 2}, {0, 0}, {0.7, 0}, {0.7, 0},
+                                    {0, 0}, {0, 0}, {1.5, 0}, {90, 0}, {Flip_Transpose, 0}, {7, Bilinear_Sampling}};
+        for (int filter = 1; filter <= 15; filter++)
+        {
+            Image_Buffer result;
+            apply_filter(image, filter, PARAMS[filter][0], PARAMS[filter][1], result);
+        }
+        process_18(image, 3);
+        process_19(image, 3, 30);
+        quantize_high_contrast(image, Floyd_Steinberg);
+        quantize_five_colors(image, Ordered_Bayer);
+        downscale_2x(image);
+        Image_Buffer overlay = make_test_overlay(image.width / 2, image.height / 2);
+        composite(image, overlay, image.width / 4, image.height / 4, Blend_Overlay);
+        Image_Buffer toned;
+        apply_tone_chain(image, {{9, 0.6}, {8, 0.6}, {2, 1.3}}, toned);
+        cout << "Profile of " << image.width << "x" << image.height << " with " << worker_count() << " threads" << endl;
+        print_stage_profile();
+        return 0;
+#else
+        cout << "Stage profiling is not compiled in; rebuild with -DIMAGE_PROFILE" << endl;
+        return 1;
+#endif
+    }
+    else if (args.size() >= 4 && args[0] == "--batch")
+    {
+        Batch_Summary summary = run_batch(args[1], args[2], stoi(args[3]), number_arg(4, 1), number_arg(5, 1),
+                                          batch_megabytes << 20, true);
+        print_batch_summary(summary);
+        return summary.failed == 0 ? 0 : 1;
+    }
+    else if (args.size() >= 2 && args[0] == "--write-corpus")
+    {
+        return write_decoder_corpus(args[1]);
+    }
+    else if (args.size() >= 2 && args[0] == "--cache-stats")
+    {
+        return print_cache_stats(args[1]);
+    }
+#ifdef __linux__
+    else if (args.size() >= 2 && args[0] == "--serve")
+    {
+        return run_server(args[1]);
+    }
+    else if (args.size() >= 5 && args[0] == "--client")
+    {
+        return run_client(args[1], stoi(args[2]), args[3], args[4], number_arg(5, 1), number_arg(6, 1));
+    }
+    else if (args.size() >= 2 && args[0] == "--loadgen")
+    {
+        return run_load_generator(args[1], number_arg(2, 9), number_arg(3, 100), number_arg(4, 4), number_arg(5, 256), number_arg(6, 256),
+                                  number_arg(7, 0.5), number_arg(8, 2));
+    }
+#endif
 
-    cout << "Black, White, Red, Green, Blue selected!" << endl << "Enter output BMP filename: ";
-    cin >> output_filename;
-    
-    image = read_image(input_filename); 
-    new_image = process_10(image); 
-    success = write_image(output_filename, new_image);
-    
-    if (success == true)
-    {cout << "Successfully applied Black, White, Red, Green, Blue filter!" << endl;}
-    else
-    {cout << "Process 10 failed" << endl;}
+    cout << "Usage:" << endl
+         << "  Lindsey_main --bench pyramid [input.bmp] [levels]" << endl
+         << "  Lindsey_main --bench dither [input.bmp]" << endl
+         << "  Lindsey_main --bench rotate [input.bmp]" << endl
+         << "  Lindsey_main --bench incremental [input.bmp]" << endl
+         << "  Lindsey_main --bench blend [input.bmp]" << endl
+         << "  Lindsey_main --bench tone [input.bmp]" << endl
+         << "  Lindsey_main --bench decode [width]" << endl
+         << "  Lindsey_main --bench batch [filter]" << endl
+         << "  Lindsey_main --bench denoise" << endl
+         << "  Lindsey_main --bench numa [width] [height]" << endl
+         << "  Lindsey_main --composite <image.bmp> <overlay.bmp> <output.bmp> [x] [y] [mode] [opacity]" << endl
+         << "    modes: 0 over, 1 multiply, 2 screen, 3 overlay" << endl
+         << "  Lindsey_main --chain <input.bmp> <output.bmp> <filter> <factor> [<filter> <factor> ...]" << endl
+         << "    filters: 2 Clarendon, 8 lighten, 9 darken, applied in order with one final rounding" << endl
+         << "  Lindsey_main --profile [input.bmp] (build with -DIMAGE_PROFILE)" << endl
+         << "  Lindsey_main --batch <input dir> <output dir> <filter> [param_1] [param_2] [--memory-budget <MB>]" << endl
+         << "  Lindsey_main --write-corpus <dir>" << endl
+         << "  Lindsey_main --selftest [--golden <file>] [--baseline <file>] [--perf-threshold <fraction>] [--no-perf]" << endl
+         << "                          [--update-golden] [--update-baseline]" << endl
+         << "  Lindsey_main --serve <socket>" << endl
+         << "  Lindsey_main --client <socket> <filter> <input.bmp> <output.bmp> [param_1] [param_2]" << endl
+         << "  Lindsey_main --loadgen <socket> [filter] [requests] [connections] [width] [height] [param_1] [param_2]" << endl
+         << "  Lindsey_main --apply <filter> <input> <output> [param_1] [param_2] [--cache <dir>] [--cache-size <MB>]" << endl
+         << "               [--in-format <name>] [--out-format <name>] [--raw-size <width>x<height>]" << endl
+         << "    formats: bmp, ppm, pgm, rgb (raw interleaved), planar (raw planar); \"-\" is stdin/stdout" << endl
+         << "    the cache is used for BMP file to BMP file only" << endl
+         << "  Lindsey_main --cache-stats <dir>" << endl
+         << "Options: --max-pixels <count> --max-bytes <count> (decode limits)" << endl
+         << "         --placement <default|thp|hugetlb|first-touch|interleave> (large buffer allocation)" << endl;
+    return 1;
 }
 
-int main()
+#ifndef IMAGE_FUZZER
+int main(int argc, char* argv[])
 {
     // Initialize all variables required prior to calling process functions
     // All variables required for each individual process are included within each individual process function
@@ -952,6 +7418,12 @@ int main()
     int user_selection = 0;
     bool stop = false;
 
+    // Any command line arguments select a non-interactive command instead of the menu
+    if (argc > 1)
+    {
+        return run_command_line(vector<string>(argv + 1, argv + argc));
+    }
+
     // Call functions to display intro message and prompt user for input file name 
     intro_message(); 
     input_filename = initial_input_filename();
@@ -969,7 +7441,16 @@ int main()
         High_Contrast,              // Process 7
         Lighten,                    // Process 8
         Darken,                     // Process 9
-        Black_White_Red_Green_Blue  // Process 10
+        Black_White_Red_Green_Blue, // Process 10
+        Thumbnail_Pyramid,          // Process 11
+        Saturation,                 // Process 12
+        Hue_Shift,                  // Process 13
+        Flip,                       // Process 14
+        Rotate_Any_Angle,           // Process 15
+        Tune_Filter,                // Interactive tuning of processes 2, 8 and 9
+        Composite,                  // Overlay another image
+        Median_Denoise,             // Process 18
+        Bilateral_Denoise           // Process 19
     };
 
     while (!stop)
@@ -1033,6 +7514,42 @@ int main()
                 process_10_wrapper(input_filename);
                 break;
 
+            case Thumbnail_Pyramid: // Process 11
+                process_11_wrapper(input_filename);
+                break;
+
+            case Saturation: // Process 12
+                process_12_wrapper(input_filename);
+                break;
+
+            case Hue_Shift: // Process 13
+                process_13_wrapper(input_filename);
+                break;
+
+            case Flip: // Process 14
+                process_14_wrapper(input_filename);
+                break;
+
+            case Rotate_Any_Angle: // Process 15
+                process_15_wrapper(input_filename);
+                break;
+
+            case Tune_Filter: // Interactive tuning
+                tune_filter_wrapper(input_filename);
+                break;
+
+            case Composite: // Overlay another image
+                composite_wrapper(input_filename);
+                break;
+
+            case Median_Denoise: // Process 18
+                process_18_wrapper(input_filename);
+                break;
+
+            case Bilateral_Denoise: // Process 19
+                process_19_wrapper(input_filename);
+                break;
+
             // Default switch case handles numerical user selections that are out of bounds of the menu selection
             default:
                 cout << "Invalid input. Select an option within the menu bounds" << endl; // reword
@@ -1041,4 +7558,5 @@ int main()
         }
     }
     return 0;
-}
\ No newline at end of file
+}
+#endif